@@ -1,16 +1,702 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <io.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
 
 #include "source/wav_source.h"
 #include "sink/sink_raw.h"
+#include "sink/sink_null.h"
 #include "parsers/ac3/ac3_enc.h"
 #include "filters/convert.h"
-#include "filters/filter_graph.h"
 #include "win32/cpu.h"
 #include "vargs.h"
+#include "shm_ring.h"
+#include "stream_io.h"
+#include "pipeline.h"
+#include "pcm_unpack.h"
+#include "hash_sink.h"
 #include "ac3enc_usage.txt.h"
 
+const enum_opt mask_tbl[] =
+{
+  { "mono",   MODE_MONO },
+  { "stereo", MODE_STEREO },
+  { "quadro", MODE_2_2 },
+  { "2.1",    MODE_2_0_LFE },
+  { "4.1",    MODE_2_2_LFE },
+  { "5.1",    MODE_5_1 },
+  { "6.1",    MODE_6_1 },
+  { "7.1",    MODE_7_1 },
+  { "l",      CH_MASK_L },
+  { "c",      CH_MASK_C },
+  { "r",      CH_MASK_R },
+  { "sl",     CH_MASK_SL },
+  { "sr",     CH_MASK_SR },
+  { "cl",     CH_MASK_CL },
+  { "cr",     CH_MASK_CR },
+  { "lfe",    CH_MASK_LFE },
+};
+
+const enum_opt format_tbl[] = 
+{
+  { "pcm16",   FORMAT_PCM16 },
+  { "pcm24",   FORMAT_PCM24 },
+  { "pcm32",   FORMAT_PCM32 },
+  { "pcm16be", FORMAT_PCM16_BE },
+  { "pcm24be", FORMAT_PCM24_BE },
+  { "pcm32be", FORMAT_PCM32_BE },
+  { "pcm_float",  FORMAT_PCMFLOAT },
+  { "pcm_double", FORMAT_PCMDOUBLE },
+};
+
+static void print_stat(double progress, int frames, double ms, double cpu, const char *eol)
+{
+  fprintf(stderr, "%2.1f%% Frames: %i\tTime: %i:%02i.%03i\tFPS: %i CPU: %.1f%%  %s", 
+    progress, 
+    frames,
+    int(ms/60000), int(ms) % 60000/1000, int(ms) % 1000,
+    int(frames * 1000 / (ms+1)),
+    cpu * 100, eol);
+}
+
+// Size of a sample of PCM format, 0 for other formats
+static int pcm_sample_size(int format)
+{
+  switch (format)
+  {
+    case FORMAT_PCM16:
+    case FORMAT_PCM16_BE:  return 2;
+    case FORMAT_PCM24:
+    case FORMAT_PCM24_BE:  return 3;
+    case FORMAT_PCM32:
+    case FORMAT_PCM32_BE:
+    case FORMAT_PCMFLOAT:  return 4;
+    case FORMAT_PCMDOUBLE: return 8;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Input stage: interleaved PCM to linear samples for the encoder.
+//
+// Supported formats are unpacked by PCMUnpacker in one pass (reorder,
+// deinterleave and convert), big endian formats go through the Converter.
+// Both write a planar buffer of their own that the encoder copies into its
+// blocks, so the copies made are the same.
+///////////////////////////////////////////////////////////////////////////////
+
+class PCMInput
+{
+protected:
+  Converter conv;
+  PCMUnpacker unpacker;
+  bool use_unpacker;
+  Speakers spk;
+
+public:
+  PCMInput(): conv(2048), use_unpacker(false)
+  {
+    conv.set_format(FORMAT_LINEAR);
+    conv.set_order(win_order);
+    unpacker.init(win_order, std_order);
+  }
+
+  void set_simd(bool simd) { unpacker.set_simd(simd); }
+
+  bool open(Speakers new_spk)
+  {
+    spk = new_spk;
+    use_unpacker = PCMUnpacker::is_supported(spk.format);
+    if (use_unpacker)
+    {
+      unpacker.reset();
+      return true;
+    }
+    return conv.open(spk);
+  }
+
+  Speakers get_output() const
+  { return use_unpacker? unpacker.get_output(spk): conv.get_output(); }
+
+  bool process(Chunk &in, Chunk &out)
+  {
+    if (!use_unpacker)
+      return conv.process(in, out);
+
+    if (!in.size)
+      return false;
+    unpacker.unpack(spk, in, out);
+    in.set_rawdata(0, 0);
+    return true;
+  }
+
+  bool flush(Chunk &out)
+  { return use_unpacker? false: conv.flush(out); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Segment-parallel encoding
+//
+// Input is cut into segments of whole AC3 frames (1536 samples). Each
+// segment is encoded by its own encoder, started a few frames before the
+// segment (preroll) and stopped a frame after it (postroll), so the MDCT
+// overlap and the encoder delay are the same as at the serial encoder.
+// Only frames of the segment itself are kept. Segments are encoded at the
+// thread pool and written in order.
+//
+// Output is the same as the serial output only if the encoder state at the
+// segment start is covered by the preroll; -check_threads compares both.
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t ac3_frame_samples = 1536;
+static const size_t preroll_frames = 2;
+static const size_t postroll_frames = 1;
+static const size_t segment_frames = 256;
+
+class EncodeJob : public PoolJob
+{
+protected:
+  size_t nframes;               // encoder output frames counted
+
+  // Delay assumption: AC3Enc writes output frame k as soon as input frame k
+  // is complete (no lookahead), and frame k depends on input frames k-1 and
+  // k only (the MDCT window overlaps the previous block). So the k-th frame
+  // out of the job encoder is the k-th input frame of the job: preroll frames
+  // are skipped by count, and the postroll frame only pads the input (its
+  // output is dropped). An encoder delay of d frames would shift the kept
+  // range by d frames.
+  void keep(const Chunk &out)
+  {
+    if (nframes >= skip_frames && (last || nframes < skip_frames + keep_frames))
+    {
+      output.insert(output.end(), out.rawdata, out.rawdata + out.size);
+      frames++;
+    }
+    nframes++;
+  }
+
+public:
+  Speakers spk;
+  int bitrate;
+  bool simd;
+  std::vector<uint8_t> input;   // PCM data: preroll, segment, postroll
+  size_t skip_frames;           // preroll frames to drop
+  size_t keep_frames;           // frames of the segment
+  bool last;                    // last segment: keep all and flush
+
+  std::vector<uint8_t> output;  // encoded frames of the segment
+  int frames;
+
+  EncodeJob(): nframes(0), bitrate(0), simd(true), skip_frames(0), keep_frames(0), last(false), frames(0)
+  {}
+
+  void run(int)
+  {
+    PCMInput pcm;
+    AC3Enc   enc;
+    pcm.set_simd(simd);
+
+    output.clear();
+    frames = 0;
+    nframes = 0;
+    if (!enc.set_bitrate(bitrate * 1000) || !pcm.open(spk) || !enc.open(pcm.get_output()))
+    {
+      err = std::string("Cannot encode format ") + spk.print();
+      return;
+    }
+
+    Chunk in, linear, out;
+    in.set_rawdata(input.size()? &input[0]: 0, input.size());
+    while (pcm.process(in, linear))
+      while (enc.process(linear, out))
+        keep(out);
+
+    if (last)
+    {
+      while (pcm.flush(linear))
+        while (enc.process(linear, out))
+          keep(out);
+      while (enc.flush(out))
+        keep(out);
+    }
+  }
+};
+
+// Encode the rest of the data at the input stage and the encoder
+static void flush_encoder(PCMInput &pcm, AC3Enc &enc, Sink &sink, int &frames)
+{
+  Chunk linear, out;
+  while (pcm.flush(linear))
+    while (enc.process(linear, out))
+    {
+      sink.process(out);
+      frames++;
+    }
+
+  while (enc.flush(out))
+  {
+    sink.process(out);
+    frames++;
+  }
+}
+
+// Passes the data to the sink and hashes it (-check_threads)
+class HashTee : public Sink
+{
+protected:
+  Sink *sink;
+
+public:
+  XXH64 hash;
+
+  HashTee(Sink *sink_): sink(sink_)
+  {}
+
+  virtual bool can_open(Speakers spk) const { return sink->can_open(spk); }
+  virtual bool open(Speakers spk)           { return sink->open(spk); }
+  virtual void close()                      { sink->close(); }
+  virtual void reset()                      { sink->reset(); }
+  virtual void flush()                      { sink->flush(); }
+  virtual bool is_open() const              { return sink->is_open(); }
+  virtual Speakers get_input() const        { return sink->get_input(); }
+
+  virtual void process(const Chunk &chunk)
+  {
+    if (chunk.size)
+      hash.update(chunk.rawdata, chunk.size);
+    sink->process(chunk);
+  }
+};
+
+// Serial encoding of the file for -check_threads: hash of the output
+static bool serial_hash(const char *filename, int bitrate, bool simd, uint64_t &hash, int &frames)
+{
+  WAVSource wav;
+  PCMInput pcm;
+  AC3Enc enc;
+  NullSink null;
+  HashTee out(&null);
+
+  if (!wav.open(filename, 65536))
+    return false;
+
+  Speakers spk = wav.get_output();
+  pcm.set_simd(simd);
+  if (!enc.set_bitrate(bitrate * 1000) || !pcm.open(spk) || !enc.open(pcm.get_output()))
+    return false;
+
+  Chunk chunk, linear, ac3;
+  frames = 0;
+  while (wav.get_chunk(chunk))
+    while (pcm.process(chunk, linear))
+      while (enc.process(linear, ac3))
+      {
+        out.process(ac3);
+        frames++;
+      }
+  flush_encoder(pcm, enc, out, frames);
+
+  hash = out.hash.digest();
+  return true;
+}
+
+// Position in the input file (%), 0 when the input is not a file
+static double progress(WAVSource *wav)
+{
+  return wav && wav->size()? double(wav->pos()) * 100.0 / wav->size(): 0.0;
+}
+
+static bool encode_parallel(Source *src, WAVSource *wav, Speakers spk, int bitrate, bool simd, int threads,
+  Sink &sink, int &frames, CPUMeter &cpu_usage, CPUMeter &cpu_total)
+{
+  size_t frame_size = ac3_frame_samples * pcm_sample_size(spk.format) * spk.nch();
+  if (!frame_size)
+  {
+    fprintf(stderr, "Error: -threads does not support format %s\n", spk.print().c_str());
+    return false;
+  }
+
+  JobPool pool;
+  if (!pool.start(threads))
+  {
+    fprintf(stderr, "Error: cannot start encoding threads\n");
+    return false;
+  }
+
+  // Ring of jobs: a few jobs per thread are in work, the oldest is written
+  // first
+  size_t i;
+  std::vector<EncodeJob *> jobs(threads * 2);
+  for (i = 0; i < jobs.size(); i++)
+    jobs[i] = new EncodeJob;
+  size_t head = 0;
+  size_t pending = 0;
+
+  std::vector<uint8_t> buf;     // input from the start of the preroll
+  size_t buf_preroll = 0;       // preroll frames at the buffer start
+  bool eof = false;
+  bool last_started = false;
+  bool ok = true;
+  double old_ms = 0;
+  Chunk chunk;
+
+  while (ok && (!last_started || pending))
+  {
+    if (!eof)
+    {
+      eof = !src->get_chunk(chunk);
+      if (!eof && src->new_stream() && !(src->get_output() == spk))
+      {
+        fprintf(stderr, "\nError: format change is not supported with -threads\n");
+        ok = false;
+        break;
+      }
+      if (!eof)
+        buf.insert(buf.end(), chunk.rawdata, chunk.rawdata + chunk.size);
+    }
+
+    // Start a job for each segment we have the input for, the rest of the
+    // input is the last segment
+    size_t need = (buf_preroll + segment_frames + postroll_frames) * frame_size;
+    bool start_job = !last_started && (eof || buf.size() >= need);
+
+    // Write the oldest job when the ring is full or at the end
+    if (pending && (pending == jobs.size() || last_started))
+    {
+      EncodeJob *job = jobs[head];
+      if (!pool.wait(job))
+      {
+        fprintf(stderr, "\nEncoding error: %s\n", job->error().c_str());
+        ok = false;
+        break;
+      }
+
+      if (job->output.size())
+      {
+        Chunk out;
+        out.set_rawdata(&job->output[0], job->output.size());
+        sink.process(out);
+      }
+      frames += job->frames;
+      head = (head + 1) % jobs.size();
+      pending--;
+
+      double ms = double(cpu_total.get_system_time() * 1000);
+      if (ms > old_ms + 100)
+      {
+        old_ms = ms;
+        print_stat(progress(wav), frames, ms, cpu_usage.usage(), "\r");
+      }
+    }
+
+    if (!start_job || pending == jobs.size())
+      continue;
+
+    EncodeJob *job = jobs[(head + pending) % jobs.size()];
+    job->spk = spk;
+    job->bitrate = bitrate;
+    job->simd = simd;
+    job->skip_frames = buf_preroll;
+    job->keep_frames = segment_frames;
+    job->last = buf.size() < need;
+    if (job->last)
+    {
+      job->input.swap(buf);
+      buf.clear();
+      last_started = true;
+    }
+    else
+    {
+      // Next segment starts segment_frames later, keep its preroll
+      job->input.assign(buf.begin(), buf.begin() + need);
+      buf.erase(buf.begin(), buf.begin() + (buf_preroll + segment_frames - preroll_frames) * frame_size);
+      buf_preroll = preroll_frames;
+    }
+    pool.submit(job);
+    pending++;
+  }
+
+  pool.stop();
+  for (i = 0; i < jobs.size(); i++)
+    delete jobs[i];
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bitrate ladder
+//
+// Several bitrates are encoded in one pass: the input is read and converted
+// once, each encoder takes the same linear data and writes its own file.
+// Output file names get the bitrate: out.ac3 -> out_192.ac3, out_384.ac3...
+//
+// Only the input is shared: each bitrate runs a full AC3Enc (MDCT,
+// exponents, bit allocation). AC3Enc does not expose its analysis, so
+// sharing the bitrate-independent part needs a change in valib.
+///////////////////////////////////////////////////////////////////////////////
+
+// Parse the list of bitrates: 192,384,448
+static bool parse_bitrates(const char *str, std::vector<int> &bitrates)
+{
+  bitrates.clear();
+  while (*str)
+  {
+    char *end;
+    long br = strtol(str, &end, 10);
+    if (end == str || br <= 0)
+      return false;
+    bitrates.push_back(int(br));
+
+    str = end;
+    if (*str == ',')
+      str++;
+    else if (*str)
+      return false;
+  }
+  return !bitrates.empty();
+}
+
+static std::string ladder_filename(const char *filename, int bitrate)
+{
+  std::string name(filename);
+  size_t dir = name.find_last_of("/\\");
+  size_t ext = name.find_last_of('.');
+  if (ext == std::string::npos || (dir != std::string::npos && ext < dir))
+    ext = name.size();
+
+  char suffix[32];
+  sprintf(suffix, "_%i", bitrate);
+  return name.substr(0, ext) + suffix + name.substr(ext);
+}
+
+class Ladder
+{
+protected:
+  PCMInput pcm;
+  std::vector<AC3Enc *> encoders;
+  std::vector<RAWSink *> sinks;
+  Chunk linear;
+
+  void encode(Chunk &chunk)
+  {
+    for (size_t i = 0; i < encoders.size(); i++)
+    {
+      Chunk in = chunk, out;
+      while (encoders[i]->process(in, out))
+      {
+        sinks[i]->process(out);
+        if (i == 0) frames++;
+      }
+    }
+  }
+
+public:
+  int frames; // frames of the first output
+
+  Ladder(): frames(0)
+  {}
+
+  ~Ladder()
+  {
+    for (size_t i = 0; i < encoders.size(); i++)
+    {
+      delete encoders[i];
+      delete sinks[i];
+    }
+  }
+
+  void set_simd(bool simd) { pcm.set_simd(simd); }
+
+  bool add(int bitrate, const char *filename)
+  {
+    AC3Enc *enc = new AC3Enc;
+    RAWSink *sink = new RAWSink;
+    encoders.push_back(enc);
+    sinks.push_back(sink);
+
+    if (!enc->set_bitrate(bitrate * 1000))
+    {
+      fprintf(stderr, "Error: Wrong bitrate %ikbps!\n", bitrate);
+      return false;
+    }
+    if (!sink->open_file(filename))
+    {
+      fprintf(stderr, "Error: Cannot open file for writing '%s'\n", filename);
+      return false;
+    }
+    return true;
+  }
+
+  bool open(Speakers spk)
+  {
+    if (!pcm.open(spk))
+      return false;
+    for (size_t i = 0; i < encoders.size(); i++)
+      if (!encoders[i]->open(pcm.get_output()))
+        return false;
+    return true;
+  }
+
+  void process(Chunk &chunk)
+  {
+    while (pcm.process(chunk, linear))
+      encode(linear);
+  }
+
+  void flush()
+  {
+    while (pcm.flush(linear))
+      encode(linear);
+
+    Chunk out;
+    for (size_t i = 0; i < encoders.size(); i++)
+      while (encoders[i]->flush(out))
+      {
+        sinks[i]->process(out);
+        if (i == 0) frames++;
+      }
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Input stage benchmark
+///////////////////////////////////////////////////////////////////////////////
+
+static double wall_time()
+{
+  LARGE_INTEGER freq, t;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return double(t.QuadPart) / double(freq.QuadPart);
+}
+
+// Time to convert the PCM block given to linear, sec. Output samples are
+// checked against the reference when it is given (max difference).
+static double bench_input(PCMInput &pcm, Speakers spk, std::vector<uint8_t> &data,
+  const std::vector<sample_t> *ref, sample_t &max_diff)
+{
+  Chunk in, out;
+  int nch = spk.nch();
+  size_t samples = data.size() / (pcm_sample_size(spk.format) * nch);
+  size_t pos = 0;
+
+  pcm.open(spk);
+  double t = wall_time();
+  in.set_rawdata(&data[0], data.size());
+  while (pcm.process(in, out))
+  {
+    if (ref)
+      for (int ch = 0; ch < nch; ch++)
+        for (size_t s = 0; s < out.size && pos + s < samples; s++)
+        {
+          sample_t diff = fabs(out.samples[ch][s] - (*ref)[ch * samples + pos + s]);
+          if (diff > max_diff) max_diff = diff;
+        }
+    pos += out.size;
+  }
+  while (pcm.flush(out))
+    pos += out.size;
+  return wall_time() - t;
+}
+
+// Converter against the fused input stage (C and SIMD kernels) on 5.1
+// PCM16: speed and the maximum difference of the results.
+static void bench_kernels(int runs)
+{
+  const size_t samples = ac3_frame_samples * 16;
+  Speakers spk(FORMAT_PCM16, MODE_5_1, 48000);
+  int nch = spk.nch();
+  int run, ch;
+  size_t s;
+
+  fprintf(stderr, "CPU: %s\n", cpu_features().simd_name());
+
+  std::vector<uint8_t> data(samples * nch * 2);
+  srand(0);
+  for (s = 0; s < samples * nch; s++)
+  {
+    int16_t v = int16_t(rand() - RAND_MAX / 2);
+    data[s * 2] = uint8_t(v);
+    data[s * 2 + 1] = uint8_t(v >> 8);
+  }
+
+  // Reference: Converter output
+  std::vector<sample_t> ref(samples * nch);
+  {
+    Converter conv(2048);
+    conv.set_format(FORMAT_LINEAR);
+    conv.set_order(win_order);
+    conv.open(spk);
+
+    Chunk in, out;
+    size_t pos = 0;
+    in.set_rawdata(&data[0], data.size());
+    while (conv.process(in, out))
+    {
+      for (ch = 0; ch < nch; ch++)
+        memcpy(&ref[ch * samples + pos], out.samples[ch], out.size * sizeof(sample_t));
+      pos += out.size;
+    }
+  }
+
+  const char *names[] = { "converter", "c", "simd" };
+  double t[3] = { 0, 0, 0 };
+  sample_t max_diff = 0;
+  for (run = 0; run <= runs; run++)
+  {
+    PCMInput pcm_c, pcm_simd;
+    pcm_c.set_simd(false);
+    pcm_simd.set_simd(true);
+
+    Converter conv(2048);
+    conv.set_format(FORMAT_LINEAR);
+    conv.set_order(win_order);
+    conv.open(spk);
+    Chunk in, out;
+    double t0 = wall_time();
+    in.set_rawdata(&data[0], data.size());
+    while (conv.process(in, out))
+      ;
+    double t1 = wall_time();
+
+    // First run is a warm-up
+    double tc = bench_input(pcm_c, spk, data, run? 0: &ref, max_diff);
+    double ts = bench_input(pcm_simd, spk, data, run? 0: &ref, max_diff);
+    if (run > 0)
+    {
+      t[0] += t1 - t0;
+      t[1] += tc;
+      t[2] += ts;
+    }
+  }
+
+  double n = double(samples) * nch * runs;
+  fprintf(stderr, "PCM input (pcm16 5.1):\n");
+  for (int i = 0; i < 3; i++)
+    fprintf(stderr, "  %-12s %8.3f ns/sample\n", names[i], t[i] * 1e9 / n);
+  if (t[2] > 0)
+    fprintf(stderr, "  speedup      %8.2fx\n", t[0] / t[2]);
+  fprintf(stderr, "  max diff     %8g\n", max_diff);
+}
+
 int ac3enc(const arg_list_t &args)
 {
+  // ac3enc -bench_kernels:N
+  if (args.size() == 2 && args[1].is_option("bench_kernels", argt_int))
+  {
+    int runs = args[1].as_int();
+    if (runs <= 0)
+    {
+      fprintf(stderr, "-bench_kernels : number of runs must be positive\n");
+      return -1;
+    }
+    bench_kernels(runs);
+    return 0;
+  }
+
   if (args.size() < 3)
   {
     fprintf(stderr, usage);
@@ -24,34 +710,194 @@ int ac3enc(const arg_list_t &args)
   const char *input_filename = args[1].raw.c_str();
   const char *output_filename = args[2].raw.c_str();
   int bitrate = 448;
+  std::vector<int> ladder_bitrates;
+  int threads = 1;
+  bool check_threads = false;
+  bool simd = true;
+
+  // Raw PCM input format
+  int raw_format = FORMAT_UNKNOWN;
+  int raw_mask = 0;
+  int raw_rate = 48000;
 
   for (size_t iarg = 3; iarg < args.size(); iarg++)
   {
     const arg_t &arg = args[iarg];
 
+    // -br:192,384,448 - bitrate ladder
+    if (arg.raw.compare(0, 4, "-br:") == 0 && arg.raw.find(',') != std::string::npos)
+    {
+      if (!parse_bitrates(arg.raw.c_str() + 4, ladder_bitrates))
+      {
+        fprintf(stderr, "-br : wrong list of bitrates: %s\n", arg.raw.c_str() + 4);
+        return -1;
+      }
+      continue;
+    }
+
     if (arg.is_option("br", argt_int))
     {
        bitrate = arg.as_int();
        continue;
     }
 
+    if (arg.is_option("threads", argt_int))
+    {
+      threads = arg.as_int();
+      if (threads < 1)
+      {
+        fprintf(stderr, "-threads : number of threads must be positive\n");
+        return -1;
+      }
+      continue;
+    }
+
+    // -check_threads - compare -threads output with the serial encoding
+    if (arg.is_option("check_threads", argt_exist))
+    {
+      check_threads = true;
+      continue;
+    }
+
+    // -simd - use SIMD kernels when the CPU supports them
+    if (arg.is_option("simd", argt_bool))
+    {
+      simd = arg.as_bool();
+      continue;
+    }
+
+    // -fmt, -spk, -rate - raw PCM input
+    if (arg.is_option("fmt", argt_enum))
+    {
+      raw_format = arg.choose(format_tbl, array_size(format_tbl));
+      continue;
+    }
+
+    if (arg.is_option("spk", argt_enum))
+    {
+      raw_mask |= arg.choose(mask_tbl, array_size(mask_tbl));
+      continue;
+    }
+
+    if (arg.is_option("rate", argt_int))
+    {
+      raw_rate = arg.as_int();
+      if (raw_rate <= 0)
+      {
+        fprintf(stderr, "-rate : sample rate must be positive\n");
+        return -1;
+      }
+      continue;
+    }
+
     fprintf(stderr, "Error: unknown option: %s\n", arg.raw.c_str());
     return -1;
   }
 
+  bool use_stdin = strcmp(input_filename, "-") == 0;
+  bool use_stdout = strcmp(output_filename, "-") == 0;
+  if (use_stdout && ladder_bitrates.size())
+  {
+    fprintf(stderr, "Error: bitrate ladder cannot write to stdout\n");
+    return -1;
+  }
+  if (raw_format == FORMAT_UNKNOWN && (raw_mask || raw_rate != 48000))
+  {
+    fprintf(stderr, "Error: specify the raw input sample format with -fmt\n");
+    return -1;
+  }
+
+  // Parallel encoding writes a segment of frames at once, stdout output
+  // must get each frame as soon as it is encoded.
+  if (use_stdout && threads > 1)
+  {
+    fprintf(stderr, "Warning: -threads is ignored with stdout output\n");
+    threads = 1;
+  }
+
+  if (ladder_bitrates.size() && threads > 1)
+  {
+    fprintf(stderr, "Error: -threads works with a single bitrate only\n");
+    return -1;
+  }
+
+  // The serial pass reads the input file again
+  if (check_threads && (threads < 2 || use_stdin || raw_format != FORMAT_UNKNOWN ||
+      strncmp(input_filename, "shm:", 4) == 0))
+  {
+    fprintf(stderr, "Error: -check_threads needs -threads:N (N > 1) and a WAV file input\n");
+    return -1;
+  }
+
   /////////////////////////////////////////////////////////
   // Open files
   /////////////////////////////////////////////////////////
 
-  WAVSource src;
-  if (!src.open(input_filename, 65536))
+  // shm:name input is the shared memory ring of another process,
+  // "-" is stdin, -fmt means headerless PCM
+  WAVSource wav;
+  ShmSource shm;
+  StreamSource stream;
+  Source *src = &wav;
+  if (raw_format != FORMAT_UNKNOWN)
+  {
+    FILE *f = stdin;
+    if (use_stdin)
+      _setmode(_fileno(stdin), _O_BINARY);
+    else
+      f = stream_open(input_filename, L"rb");
+
+    Speakers raw_spk(raw_format, raw_mask? raw_mask: MODE_STEREO, raw_rate);
+    if (!f || !stream.open_raw(f, !use_stdin, raw_spk))
+    {
+      fprintf(stderr, "Error: Cannot open raw input %s (%s)\n", input_filename, raw_spk.print().c_str());
+      return -1;
+    }
+    src = &stream;
+  }
+  else if (use_stdin)
+  {
+    _setmode(_fileno(stdin), _O_BINARY);
+    if (!stream.open_wav(stdin, false))
+    {
+      fprintf(stderr, "Error: Cannot read WAV header from stdin (not a PCM stream?)\n");
+      return -1;
+    }
+    src = &stream;
+  }
+  else if (strncmp(input_filename, "shm:", 4) == 0)
+  {
+    if (!shm.open(input_filename + 4))
+    {
+      fprintf(stderr, "Error: Cannot open shared memory ring '%s'\n", input_filename + 4);
+      return -1;
+    }
+    src = &shm;
+  }
+  else if (!wav.open(input_filename, 65536))
   {
     fprintf(stderr, "Error: Cannot open file (not a PCM file?) '%s'\n", input_filename);
     return -1;
   }
+  WAVSource *file = src == &wav? &wav: 0;
 
-  RAWSink sink;
-  if (!sink.open_file(output_filename))
+  RAWSink raw;
+  StreamSink out_stream;
+  Sink *sink = &raw;
+  Ladder ladder;
+  if (ladder_bitrates.size())
+  {
+    for (size_t i = 0; i < ladder_bitrates.size(); i++)
+      if (!ladder.add(ladder_bitrates[i], ladder_filename(output_filename, ladder_bitrates[i]).c_str()))
+        return -1;
+  }
+  else if (use_stdout)
+  {
+    _setmode(_fileno(stdout), _O_BINARY);
+    out_stream.open_stream(stdout);
+    sink = &out_stream;
+  }
+  else if (!raw.open_file(output_filename))
   {
     fprintf(stderr, "Error: Cannot open file for writing '%s'\n", output_filename);
     return -1;
@@ -61,15 +907,11 @@ int ac3enc(const arg_list_t &args)
   // Setup everything
   /////////////////////////////////////////////////////////
 
-  Converter   conv(2048);
-  AC3Enc      enc;
-  FilterChain chain;
-
-  chain.add_back(&conv);
-  chain.add_back(&enc);
+  PCMInput pcm;
+  AC3Enc   enc;
 
-  conv.set_format(FORMAT_LINEAR);
-  conv.set_order(win_order);
+  pcm.set_simd(simd);
+  ladder.set_simd(simd);
 
   if (!enc.set_bitrate(bitrate*1000))
   {
@@ -77,20 +919,28 @@ int ac3enc(const arg_list_t &args)
     return -1;
   }
 
-  Speakers spk = src.get_output();
-  if (!chain.open(spk))
+  Speakers spk = src->get_output();
+  if (!pcm.open(spk) || !enc.open(pcm.get_output()) || (ladder_bitrates.size() && !ladder.open(spk)))
   {
     fprintf(stderr, "Error: Cannot encode file (%s)!\n", spk.print().c_str());
     return -1;
   }
   fprintf(stderr, "Input format: %s\n", spk.print().c_str());
-  fprintf(stderr, "Output format: AC3 %ikbps\n", bitrate);
+  if (ladder_bitrates.size())
+    for (size_t i = 0; i < ladder_bitrates.size(); i++)
+      fprintf(stderr, "Output format: AC3 %ikbps (%s)\n", ladder_bitrates[i],
+        ladder_filename(output_filename, ladder_bitrates[i]).c_str());
+  else
+    fprintf(stderr, "Output format: AC3 %ikbps\n", bitrate);
+  if (threads > 1)
+    fprintf(stderr, "Threads: %i\n", threads);
 
   /////////////////////////////////////////////////////////
   // Process
   /////////////////////////////////////////////////////////
 
   Chunk pcm_chunk;
+  Chunk linear_chunk;
   Chunk ac3_chunk;
 
   CPUMeter cpu_usage;
@@ -105,46 +955,108 @@ int ac3enc(const arg_list_t &args)
   fprintf(stderr, "0.0%% Frs/err: 0/0\tTime: 0:00.000i\tFPS: 0 CPU: 0%%\r"); 
   int frames = 0;
 
-  while (src.get_chunk(pcm_chunk))
-    while (chain.process(pcm_chunk, ac3_chunk))
+  if (threads > 1)
+  {
+    HashTee hash_tee(sink);
+    Sink *out = check_threads? &hash_tee: sink;
+    if (!encode_parallel(src, file, spk, bitrate, simd, threads, *out, frames, cpu_usage, cpu_total))
+      return -1;
+
+    if (check_threads)
     {
-      sink.process(ac3_chunk);
-      frames++;
+      uint64_t parallel = hash_tee.hash.digest();
+      uint64_t serial = 0;
+      int serial_frames = 0;
+      fprintf(stderr, "\nSerial encoding to compare...\n");
+      if (!serial_hash(input_filename, bitrate, simd, serial, serial_frames))
+      {
+        fprintf(stderr, "Error: Cannot encode file '%s'\n", input_filename);
+        return -1;
+      }
+
+      fprintf(stderr, "Parallel: %i frames, XXH64 %08x%08x\n", frames, uint32_t(parallel >> 32), uint32_t(parallel));
+      fprintf(stderr, "Serial:   %i frames, XXH64 %08x%08x\n", serial_frames, uint32_t(serial >> 32), uint32_t(serial));
+      if (parallel != serial || frames != serial_frames)
+      {
+        fprintf(stderr, "Check failed: -threads output differs from the serial output\n");
+        return -1;
+      }
+      fprintf(stderr, "Check passed: -threads output is the same as the serial output\n");
+    }
+  }
+  else if (ladder_bitrates.size())
+  {
+    while (src->get_chunk(pcm_chunk))
+    {
+      if (src->new_stream() && !(src->get_output() == spk))
+      {
+        ladder.flush();
+        spk = src->get_output();
+        if (!ladder.open(spk))
+        {
+          fprintf(stderr, "\nError: Cannot encode format %s!\n", spk.print().c_str());
+          return -1;
+        }
+        fprintf(stderr, "\nInput format: %s\n", spk.print().c_str());
+      }
 
-      /////////////////////////////////////////////////////
-      // Statistics
+      ladder.process(pcm_chunk);
 
       ms = double(cpu_total.get_system_time() * 1000);
       if (ms > old_ms + 100)
       {
         old_ms = ms;
+        print_stat(progress(file), ladder.frames, ms, cpu_usage.usage(), "\r");
+      }
+    }
+
+    ladder.flush();
+    frames = ladder.frames;
+  }
+  else
+  {
+    while (src->get_chunk(pcm_chunk))
+    {
+      // Format may change with the shared memory input
+      if (src->new_stream() && !(src->get_output() == spk))
+      {
+        flush_encoder(pcm, enc, *sink, frames);
+
+        spk = src->get_output();
+        if (!pcm.open(spk) || !enc.open(pcm.get_output()))
+        {
+          fprintf(stderr, "\nError: Cannot encode format %s!\n", spk.print().c_str());
+          return -1;
+        }
+        fprintf(stderr, "\nInput format: %s\n", spk.print().c_str());
+      }
+
+      while (pcm.process(pcm_chunk, linear_chunk))
+        while (enc.process(linear_chunk, ac3_chunk))
+        {
+          sink->process(ac3_chunk);
+          frames++;
 
-        // Statistics
-        fprintf(stderr, "%2.1f%% Frames: %i\tTime: %i:%02i.%03i\tFPS: %i CPU: %.1f%%  \r", 
-          double(src.pos()) * 100.0 / src.size(), 
-          frames,
-          int(ms/60000), int(ms) % 60000/1000, int(ms) % 1000,
-          int(frames * 1000 / (ms+1)),
-          cpu_usage.usage() * 100);
-      } // if (ms > old_ms + 100)
+          /////////////////////////////////////////////////////
+          // Statistics
+
+          ms = double(cpu_total.get_system_time() * 1000);
+          if (ms > old_ms + 100)
+          {
+            old_ms = ms;
+            print_stat(progress(file), frames, ms, cpu_usage.usage(), "\r");
+          }
+        }
     }
 
-  /////////////////////////////////////////////////////
-  // Flush the chain
+    /////////////////////////////////////////////////////
+    // Flush the encoder
 
-  while (chain.flush(ac3_chunk))
-  {
-    sink.process(ac3_chunk);
-    frames++;
+    flush_encoder(pcm, enc, *sink, frames);
   }
 
   ms = double(cpu_total.get_system_time() * 1000);
-  fprintf(stderr, "%2.1f%% Frames: %i\tTime: %i:%02i.%03i\tFPS: %i CPU: %.1f%%  \n", 
-    double(src.pos()) * 100.0 / src.size(), 
-    frames,
-    int(ms/60000), int(ms) % 60000/1000, int(ms) % 1000,
-    int(frames * 1000 / (ms+1)),
-    cpu_usage.usage() * 100);
+  print_stat(file? progress(file): 100.0, frames, ms, cpu_usage.usage(), "\n");
 
   cpu_usage.stop();
   cpu_total.stop();
@@ -5,5 +5,60 @@ const char *usage =
 "Copyright (c) 2007-2013 by Alexander Vigovsky\n"
 "\n"
 "Usage:\n"
-"  ac3enc input.wav output.ac3 [-br:bitrate_kbps]\n"
+"  ac3enc input.wav output.ac3 [-br:bitrate_kbps] [-threads:N [-check_threads]]\n"
+"  ac3enc shm:name output.ac3 [-br:bitrate_kbps] [-threads:N]\n"
+"  ac3enc - - [-br:bitrate_kbps] [-fmt:format [-spk:layout] [-rate:N]]\n"
+"  ac3enc -bench_kernels:N\n"
+"\n"
+"  -br:br1,br2,... - bitrate ladder: encode several bitrates in one pass.\n"
+"    Input is read and converted once, one file is written per bitrate with\n"
+"    the bitrate added to the name: out.ac3 -> out_192.ac3, out_384.ac3...\n"
+"    Each bitrate is still encoded in full (MDCT, exponents and bit\n"
+"    allocation are not shared), so the ladder saves only the input reading\n"
+"    and conversion of N separate runs.\n"
+"    Example: ac3enc in.wav out.ac3 -br:192,384,448,640\n"
+"\n"
+"  -threads:N - encode at N threads. Input is cut into segments of 256 AC3\n"
+"    frames, each segment is encoded by its own encoder started 2 frames\n"
+"    before the segment. The output equals the single-threaded output only\n"
+"    if the encoder keeps no longer state than that; otherwise it differs\n"
+"    at the first frames after segment seams (each 256 frames). Use\n"
+"    -check_threads to compare. Format changes of the shm input are not\n"
+"    supported.\n"
+"\n"
+"  -check_threads - with -threads:N, encode the file serially after the\n"
+"    threaded run and compare the XXH64 hashes of both outputs. Exits with\n"
+"    an error if they differ. Needs a WAV file input longer than 256 frames\n"
+"    (8.2s at 48kHz) to cross a segment seam.\n"
+"\n"
+"  -simd[+|-] - use SIMD kernels when the CPU supports them (*)\n"
+"    PCM input is converted for the encoder in one pass: channel reordering,\n"
+"    deinterleaving and conversion to the encoder sample type are done\n"
+"    together (PCM16/24/32/float/double; big endian formats use the generic\n"
+"    converter). This makes the same copies as the generic converter: the\n"
+"    encoder still copies the converted data into its own blocks. Output is\n"
+"    the same with and without SIMD.\n"
+"\n"
+"  -bench_kernels:N - benchmark of the input stage: generic converter\n"
+"    against the one-pass conversion (C and SIMD), N runs on a 5.1 PCM16\n"
+"    block, with the maximum difference of the results.\n"
+"\n"
+"  shm:name input is the shared memory ring written by another process\n"
+"  (valdec -shm name). Encoding stops when the writer closes the ring, when\n"
+"  the writer process exits, or when no data comes for 30 seconds.\n"
+"\n"
+"  "-" as the input name is stdin, "-" as the output name is stdout. A WAV\n"
+"  stream (RIFF or RF64, data size may be unknown) is read from stdin;\n"
+"  headerless PCM is read when the format is given with -fmt (from stdin or\n"
+"  from a file). Input is read by 1536-sample blocks and each AC3 frame is\n"
+"  flushed to the output as soon as it is encoded, so memory use does not\n"
+"  depend on the stream length. -threads is ignored with stdout output (it\n"
+"  would write frames by segments). Example:\n"
+"    capture | ac3enc - - -fmt:pcm16 -spk:5.1 | player\n"
+"\n"
+"  Raw PCM input:\n"
+"    -fmt:{pcm16|pcm24|pcm32|pcm16be|pcm24be|pcm32be|pcm_float|pcm_double}\n"
+"    -spk:{mono|stereo(*)|quadro|2.1|4.1|5.1|6.1|7.1|l|c|r|sl|sr|cl|cr|lfe}\n"
+"      channels (may be given several times: -spk:stereo -spk:lfe)\n"
+"    -rate:N - sample rate (48000 by default)\n"
 ;
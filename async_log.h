@@ -0,0 +1,227 @@
+/******************************************************************************
+Asynchronous log file: log sink that does not block the logging thread.
+
+Log entries are copied into a preallocated ring buffer and written to the
+file by a background thread. The ring is a bounded multiple producer /
+single consumer queue based on per-slot sequence numbers (D. Vyukov), so
+producers never take a lock. When the ring is full the entry is dropped and
+counted instead of waiting for the writer.
+
+Entries are timestamped when received, i.e. at the logging thread. Source
+and message strings are truncated to the slot size.
+******************************************************************************/
+
+#ifndef TOOLS_ASYNC_LOG_H
+#define TOOLS_ASYNC_LOG_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "log.h"
+#include "pipeline.h"
+#include "stream_io.h"
+
+class AsyncLogFile : public LogSink
+{
+protected:
+  enum { source_size = 64, message_size = 440 };
+
+  struct Slot
+  {
+    volatile LONG seq;
+    int    level;
+    double time;
+    char   source[source_size];
+    char   message[message_size];
+  };
+
+  class Writer : public PipeThread
+  {
+  protected:
+    AsyncLogFile *log;
+    void process() { log->write_loop(); }
+
+  public:
+    Writer(AsyncLogFile *log_): log(log_) {}
+  };
+
+  std::vector<Slot> slots;
+  size_t ring_size;
+  LONG mask;
+  volatile LONG enqueue_pos;
+  LONG dequeue_pos;
+  volatile LONG overflows;
+  volatile LONG stop;
+
+  int max_log_level;
+  FILE *f;
+  HANDLE wake;
+  Writer writer;
+
+  LARGE_INTEGER freq;
+  LARGE_INTEGER start_time;
+
+  static LONG diff(LONG a, LONG b)
+  { return (LONG)((ULONG)a - (ULONG)b); }
+
+  bool pop(Slot &entry)
+  {
+    Slot &slot = slots[dequeue_pos & mask];
+    if (diff(slot.seq, dequeue_pos + 1) < 0)
+      return false;
+
+    entry.level = slot.level;
+    entry.time = slot.time;
+    memcpy(entry.source, slot.source, source_size);
+    memcpy(entry.message, slot.message, message_size);
+
+    InterlockedExchange(&slot.seq, dequeue_pos + mask + 1);
+    dequeue_pos++;
+    return true;
+  }
+
+  void write_loop()
+  {
+    Slot entry;
+    while (true)
+    {
+      WaitForSingleObject(wake, 50);
+      bool stopping = stop != 0;
+
+      while (pop(entry))
+        fprintf(f, "%10.6f %-9s %s: %s\n", entry.time, level_name(entry.level), entry.source, entry.message);
+      fflush(f);
+
+      if (stopping)
+        break;
+    }
+  }
+
+  static const char *level_name(int level)
+  {
+    if (level <= log_critical)  return "critical";
+    if (level <= log_exception) return "exception";
+    if (level <= log_error)     return "error";
+    if (level <= log_warning)   return "warning";
+    if (level <= log_event)     return "event";
+    return "trace";
+  }
+
+  static void copy_str(char *dst, const std::string &src, size_t size)
+  {
+    size_t len = src.size() < size - 1? src.size(): size - 1;
+    memcpy(dst, src.c_str(), len);
+    dst[len] = 0;
+  }
+
+public:
+  // Ring size is rounded up to a power of 2. The ring is allocated when
+  // the file is opened, so an unused log costs nothing.
+  AsyncLogFile(size_t size = 8192):
+  ring_size(2), mask(0), enqueue_pos(0), dequeue_pos(0), overflows(0), stop(0),
+  max_log_level(log_all), f(0), writer(this)
+  {
+    while (ring_size < size) ring_size *= 2;
+    wake = CreateEvent(0, FALSE, FALSE, 0);
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start_time);
+  }
+
+  ~AsyncLogFile()
+  {
+    close();
+    CloseHandle(wake);
+  }
+
+  // File name is UTF-8 (as the command line arguments)
+  bool open(const char *filename)
+  {
+    close();
+    f = stream_open(filename, L"w");
+    if (!f) return false;
+
+    slots.resize(ring_size);
+    mask = (LONG)ring_size - 1;
+    for (size_t i = 0; i < ring_size; i++)
+      slots[i].seq = (LONG)i;
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+
+    stop = 0;
+    if (!writer.start())
+    {
+      fclose(f);
+      f = 0;
+      return false;
+    }
+    return true;
+  }
+
+  // Stop receiving entries, write the rest and close the file
+  void close()
+  {
+    if (!f) return;
+
+    unsubscribe();
+    InterlockedExchange(&stop, 1);
+    SetEvent(wake);
+    writer.wait();
+
+    fclose(f);
+    f = 0;
+  }
+
+  bool is_open() const { return f != 0; }
+
+  void set_max_log_level(int level) { max_log_level = level; }
+  int get_max_log_level() const { return max_log_level; }
+
+  // Number of entries dropped because of the ring overflow
+  int get_overflows() const { return overflows; }
+
+  /////////////////////////////////////////////////////////
+  // LogSink interface
+
+  virtual void receive(const LogEntry &entry)
+  {
+    if (!f || (max_log_level >= 0 && entry.level > max_log_level))
+      return;
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    LONG pos = enqueue_pos;
+    Slot *slot;
+    while (true)
+    {
+      slot = &slots[pos & mask];
+      LONG d = diff(slot->seq, pos);
+      if (d == 0)
+      {
+        if (InterlockedCompareExchange(&enqueue_pos, pos + 1, pos) == pos)
+          break;
+      }
+      else if (d < 0)
+      {
+        // Ring is full, do not wait for the writer
+        InterlockedIncrement(&overflows);
+        SetEvent(wake);
+        return;
+      }
+      pos = enqueue_pos;
+    }
+
+    slot->level = entry.level;
+    slot->time = double(now.QuadPart - start_time.QuadPart) / double(freq.QuadPart);
+    copy_str(slot->source, entry.source, source_size);
+    copy_str(slot->message, entry.message, message_size);
+    InterlockedExchange(&slot->seq, pos + 1);
+
+    // Wake up the writer early when the ring is half full
+    if ((pos & (mask >> 1)) == 0)
+      SetEvent(wake);
+  }
+};
+
+#endif
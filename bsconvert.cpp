@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <vector>
 
 #include "auto_file.h"
 #include "parser.h"
@@ -9,6 +10,7 @@
 #include "source/source_filter.h"
 #include "bsconvert_usage.txt.h"
 #include "vargs.h"
+#include "readahead.h"
 
 inline const char *bs_name(int bs_type);
 inline bool is_14bit(int bs_type)
@@ -29,31 +31,55 @@ int bsconvert_proc(const arg_list_t &args)
   const char *out_filename = 0;
   int bs_type = BITSTREAM_8;
 
-  switch (args.size())
+  // Options may be given at any place, other arguments are positional:
+  // input file, output file, format
+  std::vector<const arg_t *> pos_args;
+  bool use_readahead = false;
+  for (size_t iarg = 1; iarg < args.size(); iarg++)
   {
-  case 2:
-    in_filename = args[1].raw.c_str();
+    const arg_t &arg = args[iarg];
+
+    // -readahead - read the input file ahead
+    if (arg.is_option("readahead", argt_bool))
+    {
+      use_readahead = arg.as_bool();
+      continue;
+    }
+
+    if (arg.raw.size() > 1 && arg.raw[0] == '-')
+    {
+      fprintf(stderr, "Error: unknown option: %s\n", arg.raw.c_str());
+      return -1;
+    }
+
+    pos_args.push_back(&arg);
+  }
+
+  switch (pos_args.size())
+  {
+  case 1:
+    in_filename = pos_args[0]->raw.c_str();
     break;
 
-  case 3:
-    in_filename = args[1].raw.c_str();
-    out_filename = args[2].raw.c_str();
+  case 2:
+    in_filename = pos_args[0]->raw.c_str();
+    out_filename = pos_args[1]->raw.c_str();
     break;
 
-  case 4:
-    in_filename = args[1].raw.c_str();
-    out_filename = args[2].raw.c_str();
-    if (args[3].raw == "8")
+  case 3:
+    in_filename = pos_args[0]->raw.c_str();
+    out_filename = pos_args[1]->raw.c_str();
+    if (pos_args[2]->raw == "8")
       bs_type = BITSTREAM_8;
-    else if (args[3].raw == "16le")
+    else if (pos_args[2]->raw == "16le")
       bs_type = BITSTREAM_16LE;
-    else if (args[3].raw == "14be")
+    else if (pos_args[2]->raw == "14be")
       bs_type = BITSTREAM_14BE;
-    else if (args[3].raw == "14le")
+    else if (pos_args[2]->raw == "14le")
       bs_type = BITSTREAM_14LE;
     else
     {
-      fprintf(stderr, "Error: Unknown stream format: %s\n", args[3].raw.c_str());
+      fprintf(stderr, "Error: Unknown stream format: %s\n", pos_args[2]->raw.c_str());
       return -1;
     }
     break;
@@ -88,6 +114,10 @@ int bsconvert_proc(const arg_list_t &args)
     return 0;
   }
 
+  ReadAhead readahead;
+  if (use_readahead && !readahead.open(in_filename))
+    fprintf(stderr, "Warning: cannot start read-ahead for '%s'\n", in_filename);
+
   /////////////////////////////////////////////////////////
   // Open output file
 
@@ -123,6 +153,8 @@ int bsconvert_proc(const arg_list_t &args)
   in_file.seek(0); // Force new stream
   while (source->get_chunk(chunk))
   {
+    readahead.update(in_file.get_pos());
+
     ///////////////////////////////////////////////////////
     // New stream
 
@@ -13,7 +13,8 @@ const char *usage =
 "  > bsconvert input_file\n"
 "\n"
 "  Convert a file:\n"
-"  > bsconvert input_file output_file [format]\n"
+"  > bsconvert input_file output_file [format] [-readahead]\n"
+"  (options may be given at any place)\n"
 "\n"
 "Options:\n"
 "  input_file  - file to convert\n"
@@ -23,6 +24,8 @@ const char *usage =
 "    16le  - 16bit low endian\n"
 "    14be  - 14bit big endian (DTS only)\n"
 "    14le  - 14bit low endian (DTS only)\n"
+"  -readahead  - read the input file ahead at a background thread (helps\n"
+"    with slow or network storage)\n"
 "\n"
 "Notes:\n"
 "  File captured from SPDIF input may contain several parts of different type.\n"
@@ -0,0 +1,55 @@
+/******************************************************************************
+Runtime CPU feature detection for the SIMD kernels of the tools.
+
+Only SSE2 is detected and used, and only by the loops the tools own (the
+output packer, the input unpacker and the level meter). Decoder kernels
+(AC3 IMDCT, MPA synthesis filterbank) belong to valib and are not
+dispatched here.
+
+SIMD kernels are compiled for any x86 or x64 build (the compiler accepts
+the intrinsics without /arch options), and the kernel is chosen at runtime
+with CPUID, so one binary uses the fastest path available at each machine.
+Kernels work with double samples only, so they are not compiled with
+FLOAT_SAMPLE.
+******************************************************************************/
+
+#ifndef TOOLS_CPU_FEATURES_H
+#define TOOLS_CPU_FEATURES_H
+
+#if !defined(FLOAT_SAMPLE) && (defined(_M_X64) || defined(_M_IX86))
+#define TOOLS_SSE2
+#include <intrin.h>
+#include <emmintrin.h>
+#endif
+
+class CPUFeatures
+{
+public:
+  bool sse2;
+
+  CPUFeatures(): sse2(false)
+  {
+#ifdef TOOLS_SSE2
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 1)
+      return;
+
+    __cpuid(info, 1);
+    sse2 = (info[3] & (1 << 26)) != 0;
+#endif
+  }
+
+  // Best instruction set used by the kernels
+  const char *simd_name() const
+  { return sse2? "sse2": "none"; }
+};
+
+// Detected once, on the first call
+inline const CPUFeatures &cpu_features()
+{
+  static CPUFeatures features;
+  return features;
+}
+
+#endif
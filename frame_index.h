@@ -0,0 +1,448 @@
+/******************************************************************************
+Frame index: compact map of a compressed audio file, stored in a sidecar
+file next to the file (file.ext.vidx).
+
+The index is built with a sampled scan: the file is probed at evenly spaced
+points, and a short run of frames after each point is parsed to get the
+start of the first frame, the stream format and the byte rate. Time between
+points is derived from the byte rate, which is exact for constant bitrate
+streams. When frame sizes show that the stream is VBR, or the points
+differ in format or frame size (a stream switch, where the time between
+the points cannot be derived from one byte rate), the sampled scan is
+dropped and the index is built with a full scan of frame headers (no
+decoding), which gives the real time of each entry.
+
+Entry offsets are frame starts and entry times are the stream times of
+these frames. find() may return a position between entries for CBR
+streams: this is a starting point for the sync search, and time_at() gives
+the exact time of the frame the parser syncs to.
+
+Sidecar is valid only for the file with the same size and modification
+time. Data is stored in native byte order.
+******************************************************************************/
+
+#ifndef TOOLS_FRAME_INDEX_H
+#define TOOLS_FRAME_INDEX_H
+
+#include <windows.h>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "source/file_parser.h"
+
+struct FrameIndexEntry
+{
+  uint64_t offset;      // file position of the frame start
+  double   time;        // stream time of the frame (sec)
+  double   byte_rate;   // bytes per second of the stream at the offset
+  int32_t  format;      // stream format
+  int32_t  mask;        // channel mask
+  int32_t  sample_rate; // sample rate
+  int32_t  flags;       // FrameIndex::stream_start
+
+  Speakers get_spk() const
+  { return Speakers(format, mask, sample_rate); }
+};
+
+class FrameIndex
+{
+public:
+  enum { stream_start = 1 };
+
+  FrameIndex(): file_size(0), file_time(0), total_duration(0), vbr(false)
+  {}
+
+  static std::string sidecar_name(const char *filename)
+  { return std::string(filename) + ".vidx"; }
+
+  void clear()
+  {
+    entries.clear();
+    file_size = 0;
+    file_time = 0;
+    total_duration = 0;
+    vbr = false;
+  }
+
+  bool is_empty() const { return entries.empty(); }
+  size_t size() const { return entries.size(); }
+  const FrameIndexEntry &operator [](size_t i) const { return entries[i]; }
+
+  double duration() const { return total_duration; }
+  bool is_vbr() const { return vbr; }
+
+  int streams() const
+  {
+    int n = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+      if (entries[i].flags & stream_start)
+        n++;
+    return n;
+  }
+
+  /////////////////////////////////////////////////////////
+  // Build the index for a file opened with FileParser: sampled
+  // scan, or full scan of frame headers for VBR streams.
+  // Leaves the parser at an arbitrary position.
+
+  bool build(FileParser &file, const char *filename)
+  {
+    clear();
+    if (!file_stamp(filename, file_size, file_time))
+      return false;
+
+    if (sampled_scan(file))
+      return true;
+
+    // VBR stream or the sampled scan found nothing
+    entries.clear();
+    vbr = true;
+    return full_scan(file);
+  }
+
+  /////////////////////////////////////////////////////////
+  // Sidecar file
+
+  bool load(const char *index_filename, const char *filename)
+  {
+    clear();
+
+    uint64_t size, time;
+    if (!file_stamp(filename, size, time))
+      return false;
+
+    FILE *f = open_file(index_filename, L"rb");
+    if (!f) return false;
+
+    // Size of the index file limits the number of entries
+    uint64_t index_size = 0;
+    if (_fseeki64(f, 0, SEEK_END) == 0)
+      index_size = uint64_t(_ftelli64(f));
+    _fseeki64(f, 0, SEEK_SET);
+
+    Header h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+      memcmp(h.magic, "VIDX", 4) == 0 &&
+      h.version == version &&
+      h.entry_size == sizeof(FrameIndexEntry) &&
+      h.file_size == size &&
+      h.file_time == time &&
+      h.entries > 0 &&
+      h.entries <= max_entries &&
+      index_size == sizeof(h) + h.entries * sizeof(FrameIndexEntry);
+
+    if (ok)
+    {
+      entries.resize(size_t(h.entries));
+      ok = fread(&entries[0], sizeof(FrameIndexEntry), entries.size(), f) == entries.size();
+    }
+    fclose(f);
+
+    if (!ok)
+    {
+      clear();
+      return false;
+    }
+
+    file_size = h.file_size;
+    file_time = h.file_time;
+    total_duration = h.duration;
+    vbr = (h.flags & flag_vbr) != 0;
+    return true;
+  }
+
+  bool save(const char *index_filename) const
+  {
+    if (entries.empty())
+      return false;
+
+    FILE *f = open_file(index_filename, L"wb");
+    if (!f) return false;
+
+    Header h;
+    memcpy(h.magic, "VIDX", 4);
+    h.version = version;
+    h.entry_size = sizeof(FrameIndexEntry);
+    h.flags = vbr? flag_vbr: 0;
+    h.file_size = file_size;
+    h.file_time = file_time;
+    h.duration = total_duration;
+    h.entries = entries.size();
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+      fwrite(&entries[0], sizeof(FrameIndexEntry), entries.size(), f) == entries.size();
+    ok = (fclose(f) == 0) && ok;
+    return ok;
+  }
+
+  /////////////////////////////////////////////////////////
+  // Seeking
+  //
+  // Find the file position for the time given. Returns the position to
+  // start the sync search from and the stream time at this position.
+  // For VBR streams this is the entry at or before the time (a frame
+  // start with the exact time), CBR positions are interpolated.
+
+  bool find(double time, uint64_t &offset, double &offset_time) const
+  {
+    if (entries.empty())
+      return false;
+
+    if (time <= 0)
+    {
+      offset = 0;
+      offset_time = 0;
+      return true;
+    }
+
+    // Last entry with entry.time <= time
+    size_t lo = 0, hi = entries.size();
+    while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (entries[mid].time <= time)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    const FrameIndexEntry &e = entries[lo];
+    if (vbr)
+    {
+      offset = e.offset;
+      offset_time = e.time;
+      return true;
+    }
+
+    uint64_t end = (lo + 1 < entries.size())? entries[lo + 1].offset: file_size;
+    double delta = (time - e.time) * e.byte_rate;
+
+    offset = e.offset + uint64_t(delta);
+    if (offset > end)
+      offset = end;
+    offset_time = e.time + double(offset - e.offset) / e.byte_rate;
+    return true;
+  }
+
+  // Stream time of the frame that starts at the file position given (as
+  // found by the parser after a seek). Exact for CBR streams and for
+  // entry offsets of VBR streams.
+  double time_at(uint64_t frame_pos) const
+  {
+    if (entries.empty() || frame_pos <= entries[0].offset)
+      return 0;
+
+    // Last entry with entry.offset <= frame_pos
+    size_t lo = 0, hi = entries.size();
+    while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (entries[mid].offset <= frame_pos)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    const FrameIndexEntry &e = entries[lo];
+    return e.time + double(frame_pos - e.offset) / e.byte_rate;
+  }
+
+protected:
+  enum { version = 2 };
+  enum { flag_vbr = 1 };
+  enum { max_entries = 16 * 1024 * 1024 };
+  enum { run_frames = 8 };          // frames parsed at each point
+  enum { max_padding = 4 };         // frame size difference allowed (MPA padding)
+
+  // Seconds between entries of the full scan
+  static double full_scan_step() { return 0.5; }
+
+  struct Header
+  {
+    char     magic[4];
+    int32_t  version;
+    int32_t  entry_size;
+    int32_t  flags;
+    uint64_t file_size;
+    uint64_t file_time;
+    double   duration;
+    uint64_t entries;
+  };
+
+  std::vector<FrameIndexEntry> entries;
+  uint64_t file_size;
+  uint64_t file_time;
+  double   total_duration;
+  bool     vbr;
+
+  static bool same_stream(const FrameIndexEntry &a, const FrameIndexEntry &b)
+  { return a.format == b.format && a.mask == b.mask && a.sample_rate == b.sample_rate; }
+
+  static size_t size_diff(size_t a, size_t b)
+  { return a > b? a - b: b - a; }
+
+  // Sampled scan. Fails for VBR streams: byte rate differs between the
+  // frames of a run or between points. Fails for several streams too: the
+  // format or the frame size differs between the frames of a run or between
+  // points, so the time of the switch is unknown.
+  bool sampled_scan(FileParser &file)
+  {
+    // About one point per megabyte
+    const uint64_t step = 1024 * 1024;
+    uint64_t npoints = file_size / step;
+    if (npoints < 64)   npoints = 64;
+    if (npoints > 4096) npoints = 4096;
+
+    Chunk chunk;
+    size_t frame_size = 0;  // frame size at the first point
+    for (uint64_t i = 0; i < npoints; i++)
+    {
+      uint64_t pos = file_size * i / npoints;
+      if (!entries.empty() && pos <= entries.back().offset)
+        continue;
+
+      file.seek(fsize_t(pos));
+      if (!file.get_chunk(chunk))
+        continue;
+
+      // The parser syncs at the next frame after the position
+      uint64_t frame_pos = uint64_t(file.get_pos() - chunk.size);
+      if (!entries.empty() && frame_pos <= entries.back().offset)
+        continue;
+
+      FrameInfo finfo = file.frame_info();
+      Speakers spk = file.get_output();
+      if (!finfo.nsamples || !finfo.frame_size || !finfo.spk.sample_rate)
+        continue;
+
+      if (!frame_size)
+        frame_size = finfo.frame_size;
+      if (size_diff(finfo.frame_size, frame_size) > max_padding)
+        return false;
+
+      // Byte rate over a run of frames. Small differences are allowed:
+      // padding of MPEG frames changes the frame size by a byte.
+      double frame_rate = double(finfo.frame_size) * finfo.spk.sample_rate / finfo.nsamples;
+      double bytes = finfo.frame_size;
+      double samples = finfo.nsamples;
+      for (int j = 1; j < run_frames && file.get_chunk(chunk); j++)
+      {
+        FrameInfo next = file.frame_info();
+        if (!(file.get_output() == spk) || next.spk.sample_rate != finfo.spk.sample_rate ||
+            size_diff(next.frame_size, frame_size) > max_padding)
+          return false;
+        if (!next.nsamples)
+          break;
+
+        double rate = double(next.frame_size) * next.spk.sample_rate / next.nsamples;
+        if (fabs(rate - frame_rate) > frame_rate * 0.01)
+          return false;
+        bytes += next.frame_size;
+        samples += next.nsamples;
+      }
+
+      FrameIndexEntry entry;
+      entry.offset      = frame_pos;
+      entry.time        = 0;
+      entry.byte_rate   = bytes * finfo.spk.sample_rate / samples;
+      entry.format      = spk.format;
+      entry.mask        = spk.mask;
+      entry.sample_rate = spk.sample_rate;
+      entry.flags       = 0;
+
+      if (entries.empty())
+        entry.flags |= stream_start;
+      else if (!same_stream(entries.back(), entry) ||
+               fabs(entry.byte_rate - entries.back().byte_rate) > entry.byte_rate * 0.01)
+        return false;
+
+      if (!entries.empty())
+      {
+        const FrameIndexEntry &prev = entries.back();
+        entry.time = prev.time + double(entry.offset - prev.offset) / prev.byte_rate;
+      }
+      entries.push_back(entry);
+    }
+
+    if (entries.empty())
+      return false;
+
+    const FrameIndexEntry &last = entries.back();
+    total_duration = last.time + double(file_size - last.offset) / last.byte_rate;
+    return true;
+  }
+
+  // Full scan of frame headers: an entry at each stream start and each
+  // full_scan_step() seconds, with the real frame start and time.
+  bool full_scan(FileParser &file)
+  {
+    Chunk chunk;
+    double time = 0;
+
+    file.seek(0);
+    while (file.get_chunk(chunk))
+    {
+      FrameInfo finfo = file.frame_info();
+      Speakers spk = file.get_output();
+      if (!finfo.nsamples || !finfo.frame_size || !finfo.spk.sample_rate)
+        continue;
+
+      double frame_time = double(finfo.nsamples) / finfo.spk.sample_rate;
+
+      FrameIndexEntry entry;
+      entry.offset      = uint64_t(file.get_pos() - chunk.size);
+      entry.time        = time;
+      entry.byte_rate   = double(finfo.frame_size) / frame_time;
+      entry.format      = spk.format;
+      entry.mask        = spk.mask;
+      entry.sample_rate = spk.sample_rate;
+      entry.flags       = 0;
+      time += frame_time;
+
+      if (entries.empty() || !same_stream(entries.back(), entry))
+        entry.flags |= stream_start;
+      else if (entry.time < entries.back().time + full_scan_step())
+        continue;
+
+      entries.push_back(entry);
+    }
+
+    if (entries.empty())
+      return false;
+
+    // Average byte rate between entries of the same stream
+    for (size_t i = 0; i + 1 < entries.size(); i++)
+      if (!(entries[i + 1].flags & stream_start) && entries[i + 1].time > entries[i].time)
+        entries[i].byte_rate = double(entries[i + 1].offset - entries[i].offset) / (entries[i + 1].time - entries[i].time);
+
+    total_duration = time;
+    return true;
+  }
+
+  static std::wstring utf8_to_wide(const char *str)
+  {
+    int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, 0, 0);
+    if (len <= 0) return std::wstring();
+    std::vector<wchar_t> buf(len);
+    MultiByteToWideChar(CP_UTF8, 0, str, -1, &buf[0], len);
+    return std::wstring(&buf[0]);
+  }
+
+  static FILE *open_file(const char *filename, const wchar_t *mode)
+  { return _wfopen(utf8_to_wide(filename).c_str(), mode); }
+
+  // Size and modification time of a file
+  static bool file_stamp(const char *filename, uint64_t &size, uint64_t &time)
+  {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(utf8_to_wide(filename).c_str(), GetFileExInfoStandard, &data))
+      return false;
+
+    size = (uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    time = (uint64_t(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,291 @@
+/******************************************************************************
+HashSink: sink that hashes the output data instead of writing it.
+
+Used for bit-exact regression checks: hashes of the decoded data are
+compared to the reference hashes instead of comparing multi-gigabyte WAV
+files. The data is hashed with XXH64 (seed 0), so the hash of a stream is
+the same as the XXH64 of the RAW file with this stream.
+
+A hash is printed to stdout for each stream (continuous part of the output
+with the same format) and optionally for each segment of N output samples.
+Positions are counted in output samples from the start of the output, and
+segments are cut at exact multiples of N samples from the stream start, so
+they do not depend on how the output is split into chunks (frame-parallel
+and single-threaded decoding give the same segments):
+
+  segment <first sample>-<last sample> <hash>
+  stream <n> <format> samples <first>-<last> bytes <size> <hash>
+******************************************************************************/
+
+#ifndef TOOLS_HASH_SINK_H
+#define TOOLS_HASH_SINK_H
+
+#include <stdio.h>
+#include <string.h>
+#include "sink.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// XXH64 - streaming 64bit xxHash
+
+class XXH64
+{
+protected:
+  uint64_t v[4];
+  uint64_t total_len;
+  uint8_t  mem[32];
+  size_t   mem_size;
+
+  static const uint64_t p1 = 11400714785074694791ULL;
+  static const uint64_t p2 = 14029467366897019727ULL;
+  static const uint64_t p3 =  1609587929392839161ULL;
+  static const uint64_t p4 =  9650029242287828579ULL;
+  static const uint64_t p5 =  2870177450012600261ULL;
+
+  static uint64_t rotl(uint64_t x, int r)
+  { return (x << r) | (x >> (64 - r)); }
+
+  static uint64_t read64(const uint8_t *p)
+  { uint64_t v; memcpy(&v, p, 8); return v; }
+
+  static uint32_t read32(const uint8_t *p)
+  { uint32_t v; memcpy(&v, p, 4); return v; }
+
+  static uint64_t round(uint64_t acc, uint64_t input)
+  {
+    acc += input * p2;
+    acc = rotl(acc, 31);
+    return acc * p1;
+  }
+
+  static uint64_t merge_round(uint64_t acc, uint64_t val)
+  {
+    acc ^= round(0, val);
+    return acc * p1 + p4;
+  }
+
+public:
+  XXH64()
+  { reset(); }
+
+  void reset()
+  {
+    v[0] = p1 + p2;
+    v[1] = p2;
+    v[2] = 0;
+    v[3] = 0 - p1;
+    total_len = 0;
+    mem_size = 0;
+  }
+
+  void update(const uint8_t *data, size_t size)
+  {
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    total_len += size;
+
+    if (mem_size + size < 32)
+    {
+      memcpy(mem + mem_size, data, size);
+      mem_size += size;
+      return;
+    }
+
+    if (mem_size)
+    {
+      memcpy(mem + mem_size, p, 32 - mem_size);
+      p += 32 - mem_size;
+      v[0] = round(v[0], read64(mem));
+      v[1] = round(v[1], read64(mem + 8));
+      v[2] = round(v[2], read64(mem + 16));
+      v[3] = round(v[3], read64(mem + 24));
+      mem_size = 0;
+    }
+
+    for (; p + 32 <= end; p += 32)
+    {
+      v[0] = round(v[0], read64(p));
+      v[1] = round(v[1], read64(p + 8));
+      v[2] = round(v[2], read64(p + 16));
+      v[3] = round(v[3], read64(p + 24));
+    }
+
+    mem_size = end - p;
+    memcpy(mem, p, mem_size);
+  }
+
+  uint64_t digest() const
+  {
+    uint64_t h;
+    if (total_len >= 32)
+    {
+      h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+      h = merge_round(h, v[0]);
+      h = merge_round(h, v[1]);
+      h = merge_round(h, v[2]);
+      h = merge_round(h, v[3]);
+    }
+    else
+      h = p5;
+
+    h += total_len;
+
+    const uint8_t *p = mem;
+    const uint8_t *end = mem + mem_size;
+    for (; p + 8 <= end; p += 8)
+    {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * p1 + p4;
+    }
+    if (p + 4 <= end)
+    {
+      h ^= uint64_t(read32(p)) * p1;
+      h = rotl(h, 23) * p2 + p3;
+      p += 4;
+    }
+    for (; p < end; p++)
+    {
+      h ^= uint64_t(*p) * p5;
+      h = rotl(h, 11) * p1;
+    }
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  uint64_t size() const { return total_len; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// HashSink
+
+class HashSink : public Sink
+{
+protected:
+  Speakers spk;
+  XXH64 stream_hash;
+  XXH64 segment_hash;
+
+  int streams;
+  int segment_samples;  // samples per segment (0 = no segment hashes)
+  size_t sample_bytes;  // size of a sample of all channels
+  double stream_start;  // first sample of the stream
+  double segment_start; // first sample of the segment
+
+  static void print_hash(uint64_t h)
+  { printf("%08x%08x", uint32_t(h >> 32), uint32_t(h)); }
+
+  // Sample position after the data hashed
+  double stream_end() const
+  { return stream_start + double(stream_hash.size() / sample_bytes); }
+
+  void end_segment()
+  {
+    if (!segment_samples || !segment_hash.size())
+      return;
+
+    double end = segment_start + double(segment_hash.size() / sample_bytes);
+    printf("segment %.0f-%.0f ", segment_start, end - 1);
+    print_hash(segment_hash.digest());
+    printf("\n");
+    segment_hash.reset();
+    segment_start = end;
+  }
+
+  void end_stream()
+  {
+    if (spk.format == FORMAT_UNKNOWN)
+      return;
+
+    end_segment();
+    double end = stream_end();
+    printf("stream %i %s samples %.0f-%.0f bytes %.0f ", streams, spk.print().c_str(),
+      stream_start, end - 1, double(stream_hash.size()));
+    print_hash(stream_hash.digest());
+    printf("\n");
+    fflush(stdout);
+
+    stream_hash.reset();
+    stream_start = end;
+    spk = Speakers();
+  }
+
+public:
+  HashSink(): streams(0), segment_samples(0), sample_bytes(1), stream_start(0), segment_start(0)
+  {}
+
+  void set_segment_samples(int n) { segment_samples = n > 0? n: 0; }
+  int get_segment_samples() const { return segment_samples; }
+
+  /////////////////////////////////////////////////////////
+  // Sink interface
+
+  virtual bool can_open(Speakers new_spk) const
+  { return new_spk.format != FORMAT_UNKNOWN && new_spk.format != FORMAT_LINEAR; }
+
+  virtual bool open(Speakers new_spk)
+  {
+    if (!can_open(new_spk))
+      return false;
+
+    end_stream();
+    spk = new_spk;
+    sample_bytes = spk.nch() * spk.sample_size();
+    if (!sample_bytes)
+      sample_bytes = 1;
+    streams++;
+    segment_start = stream_start;
+    segment_hash.reset();
+    return true;
+  }
+
+  virtual void close()
+  { end_stream(); }
+
+  virtual void reset()
+  {
+    stream_hash.reset();
+    segment_hash.reset();
+  }
+
+  virtual void process(const Chunk &chunk)
+  {
+    if (spk.format == FORMAT_UNKNOWN || !chunk.size)
+      return;
+
+    stream_hash.update(chunk.rawdata, chunk.size);
+    if (!segment_samples)
+      return;
+
+    // Cut the chunk at the segment boundaries
+    const size_t segment_bytes = segment_samples * sample_bytes;
+    const uint8_t *data = chunk.rawdata;
+    size_t size = chunk.size;
+    while (size)
+    {
+      size_t n = segment_bytes - size_t(segment_hash.size());
+      if (n > size)
+        n = size;
+      segment_hash.update(data, n);
+      data += n;
+      size -= n;
+      if (segment_hash.size() >= segment_bytes)
+        end_segment();
+    }
+  }
+
+  // End of data: print the hashes of the current stream
+  virtual void flush()
+  { end_stream(); }
+
+  virtual bool is_open() const
+  { return spk.format != FORMAT_UNKNOWN; }
+
+  virtual Speakers get_input() const
+  { return spk; }
+};
+
+#endif
@@ -0,0 +1,318 @@
+/******************************************************************************
+LevelMeter: per-channel peak and RMS levels for each window of a given
+length, written to a CSV or a binary file.
+
+Works with linear data. Levels are relative to the level of the format
+(full scale). Output gains given with set_gains() are applied to the
+levels, so when the gains are applied after metering (fused output stage)
+the levels are still the output levels. Levels are measured before
+clipping, so overloads show as levels above 0dB.
+
+CSV file has levels in dB, one line per window. Header is written once and
+has columns for all channels, so the file stays a single table when the
+format changes; channels missing in the current format are left empty:
+
+  time,l_peak,l_rms,c_peak,c_rms,r_peak,r_rms,...
+
+Binary file is a sequence of blocks, a new block starts at each format
+change:
+
+  header: "VLVL", int32 nch, int32 sample_rate, double window,
+          int32 channel names[nch]
+  window: double time, float peak[nch], float rms[nch] (linear, not dB)
+
+Window time is the time of the window start. The last window may be
+shorter than others.
+
+Measurement kernel is chosen at runtime (SSE2 or C). SSE2 kernel sums in a
+different order, so RMS values may differ from the C kernel in the last
+bits (relative difference within 1e-12). Peaks are the same.
+******************************************************************************/
+
+#ifndef TOOLS_LEVEL_METER_H
+#define TOOLS_LEVEL_METER_H
+
+#include <math.h>
+#include <stdio.h>
+#include "filter.h"
+#include "cpu_features.h"
+
+class LevelMeter
+{
+protected:
+  FILE  *f;
+  bool   binary;
+  double window;        // window length (sec)
+  double time_offset;   // time of the first sample
+
+  Speakers spk;
+  int    nch;
+  int    names[NCHANNELS];
+  size_t window_size;   // window length in samples
+  size_t window_pos;    // samples in the current window
+  double window_time;   // current window start time
+
+  sample_t peak[NCHANNELS];
+  double   sumsq[NCHANNELS];
+  bool     simd;        // use the SIMD kernel
+  bool     csv_header;  // CSV header is written
+
+  sample_t gains[CH_NAMES];   // output gains by channel name
+
+  static const char *ch_short_name(int ch)
+  {
+    switch (ch)
+    {
+      case CH_L:   return "l";
+      case CH_C:   return "c";
+      case CH_R:   return "r";
+      case CH_SL:  return "sl";
+      case CH_SR:  return "sr";
+      case CH_LFE: return "lfe";
+      case CH_BL:  return "bl";
+      case CH_BC:  return "bc";
+      case CH_BR:  return "br";
+      case CH_CL:  return "cl";
+      case CH_CR:  return "cr";
+    }
+    return "ch";
+  }
+
+  void measure(const sample_t *s, size_t n, sample_t &peak, double &sumsq) const
+  {
+#ifdef TOOLS_SSE2
+    if (simd)
+    {
+      measure_sse2(s, n, peak, sumsq);
+      return;
+    }
+#endif
+    measure_c(s, n, peak, sumsq);
+  }
+
+  void write_header()
+  {
+    int ch;
+    if (binary)
+    {
+      int32_t h[2] = { nch, spk.sample_rate };
+      int32_t ch_names[NCHANNELS];
+      for (ch = 0; ch < nch; ch++)
+        ch_names[ch] = names[ch];
+
+      fwrite("VLVL", 4, 1, f);
+      fwrite(h, sizeof(h), 1, f);
+      fwrite(&window, sizeof(window), 1, f);
+      fwrite(ch_names, sizeof(int32_t), nch, f);
+    }
+    else if (!csv_header)
+    {
+      fprintf(f, "time");
+      for (ch = 0; ch < CH_NAMES; ch++)
+        fprintf(f, ",%s_peak,%s_rms", ch_short_name(ch), ch_short_name(ch));
+      fprintf(f, "\n");
+      csv_header = true;
+    }
+  }
+
+  void write_window()
+  {
+    int ch;
+    if (!window_pos)
+      return;
+
+    // Output gain is constant over the window, so it scales the peak and
+    // the RMS of the window.
+    double level = spk.level > 0? spk.level: 1.0;
+    double ch_peak[NCHANNELS], ch_rms[NCHANNELS];
+    for (ch = 0; ch < nch; ch++)
+    {
+      double g = fabs(gains[names[ch]]) / level;
+      ch_peak[ch] = peak[ch] * g;
+      ch_rms[ch] = sqrt(sumsq[ch] / window_pos) * g;
+    }
+
+    if (binary)
+    {
+      float values[NCHANNELS * 2];
+      for (ch = 0; ch < nch; ch++)
+      {
+        values[ch] = float(ch_peak[ch]);
+        values[nch + ch] = float(ch_rms[ch]);
+      }
+      fwrite(&window_time, sizeof(window_time), 1, f);
+      fwrite(values, sizeof(float), nch * 2, f);
+    }
+    else
+    {
+      fprintf(f, "%.3f", window_time);
+      for (int name = 0; name < CH_NAMES; name++)
+      {
+        for (ch = 0; ch < nch && names[ch] != name; ch++)
+          ;
+        if (ch < nch)
+          fprintf(f, ",%.2f,%.2f", value2db(ch_peak[ch]), value2db(ch_rms[ch]));
+        else
+          fprintf(f, ",,");
+      }
+      fprintf(f, "\n");
+    }
+
+    window_time += double(window_pos) / spk.sample_rate;
+    window_pos = 0;
+    for (ch = 0; ch < nch; ch++)
+    {
+      peak[ch] = 0;
+      sumsq[ch] = 0;
+    }
+  }
+
+  void set_format(Speakers new_spk)
+  {
+    write_window();
+
+    spk = new_spk;
+    nch = 0;
+    for (int ch = 0; ch < CH_NAMES && nch < NCHANNELS; ch++)
+      if (spk.mask & CH_MASK(ch))
+      {
+        names[nch] = ch;
+        peak[nch] = 0;
+        sumsq[nch] = 0;
+        nch++;
+      }
+
+    window_size = size_t(window * spk.sample_rate + 0.5);
+    if (window_size < 1)
+      window_size = 1;
+    window_pos = 0;
+    write_header();
+  }
+
+public:
+  /////////////////////////////////////////////////////////
+  // Kernels: accumulate peak and sum of squares of a block
+
+  static void measure_c(const sample_t *s, size_t n, sample_t &peak, double &sumsq)
+  {
+    sample_t p = peak;
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      sample_t v = s[i] < 0? -s[i]: s[i];
+      if (v > p) p = v;
+      sum += double(s[i]) * s[i];
+    }
+    peak = p;
+    sumsq += sum;
+  }
+
+#ifdef TOOLS_SSE2
+  static void measure_sse2(const sample_t *s, size_t n, sample_t &peak, double &sumsq)
+  {
+    size_t i = 0;
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d vp = _mm_set1_pd(peak);
+    __m128d vs = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2)
+    {
+      __m128d v = _mm_loadu_pd(s + i);
+      vp = _mm_max_pd(vp, _mm_andnot_pd(sign, v));
+      vs = _mm_add_pd(vs, _mm_mul_pd(v, v));
+    }
+
+    double tmp[2];
+    _mm_storeu_pd(tmp, vp);
+    peak = tmp[0] > tmp[1]? tmp[0]: tmp[1];
+    _mm_storeu_pd(tmp, vs);
+    sumsq += tmp[0] + tmp[1];
+
+    // Odd sample
+    measure_c(s + i, n - i, peak, sumsq);
+  }
+#endif
+
+  /////////////////////////////////////////////////////////
+
+  LevelMeter(): f(0), binary(false), window(0.1), time_offset(0),
+  nch(0), window_size(0), window_pos(0), window_time(0),
+  simd(cpu_features().sse2), csv_header(false)
+  {
+    for (int ch = 0; ch < CH_NAMES; ch++)
+      gains[ch] = 1.0;
+  }
+
+  ~LevelMeter()
+  { close(); }
+
+  bool open(const char *filename, bool binary_, double window_, double time_offset_ = 0)
+  {
+    close();
+    if (window_ <= 0)
+      return false;
+
+    f = fopen(filename, binary_? "wb": "w");
+    if (!f) return false;
+
+    binary = binary_;
+    window = window_;
+    time_offset = time_offset_;
+    window_time = time_offset;
+    spk = Speakers();
+    nch = 0;
+    window_pos = 0;
+    csv_header = false;
+    return true;
+  }
+
+  // Write the last window and close the file
+  bool close()
+  {
+    if (!f) return true;
+    if (spk.sample_rate)
+      write_window();
+    bool ok = fclose(f) == 0;
+    f = 0;
+    return ok;
+  }
+
+  bool is_open() const { return f != 0; }
+
+  // Output gains by channel name, applied after metering
+  void set_gains(const sample_t new_gains[CH_NAMES])
+  {
+    for (int ch = 0; ch < CH_NAMES; ch++)
+      gains[ch] = new_gains[ch];
+  }
+
+  // Use the SIMD kernel when the CPU supports it (default) or force C
+  void set_simd(bool use_simd) { simd = use_simd && cpu_features().sse2; }
+  bool get_simd() const { return simd; }
+
+  void process(Speakers new_spk, const Chunk &chunk)
+  {
+    if (!f || new_spk.format != FORMAT_LINEAR || !new_spk.sample_rate)
+      return;
+
+    if (!(new_spk == spk))
+      set_format(new_spk);
+
+    size_t pos = 0;
+    while (pos < chunk.size)
+    {
+      size_t n = window_size - window_pos;
+      if (n > chunk.size - pos)
+        n = chunk.size - pos;
+
+      for (int ch = 0; ch < nch; ch++)
+        measure(chunk.samples[ch] + pos, n, peak[ch], sumsq[ch]);
+
+      pos += n;
+      window_pos += n;
+      if (window_pos >= window_size)
+        write_window();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,268 @@
+/******************************************************************************
+PCMPacker: fused output stage. Converts planar linear samples into
+interleaved PCM in one pass: output channel gains, channel reordering,
+clipping and packing to the sample format are done together.
+
+Input must be in the standard channel order without output gains applied
+(the processor is set up with unity output gains and std_order), output
+gains are indexed by channel name as for AudioProcessor::set_output_gains().
+
+Integer formats are converted in short blocks: a block is scaled, clipped
+and rounded per channel into a small buffer that stays in the cache, then
+interleaved into the output. The block kernel is chosen at runtime: SSE2
+when the CPU has it, C otherwise. Both round as floor(v + 0.5) (exact
+halves up) and do not depend on the rounding mode of the CPU, so the output
+does not depend on the kernel.
+
+Supported formats: PCM16, PCM24, PCM32 (little endian), PCM Float and
+PCM Double.
+******************************************************************************/
+
+#ifndef TOOLS_PCM_PACK_H
+#define TOOLS_PCM_PACK_H
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "filter.h"
+#include "cpu_features.h"
+
+class PCMPacker
+{
+protected:
+  enum { block_size = 256 };
+
+  int format;
+  int sample_size;
+  sample_t lo, hi;                // clipping range for integer formats
+  sample_t gains[CH_NAMES];       // output gains by channel name
+  int in_order[CH_NAMES];         // order of input channels
+  int out_order[CH_NAMES];        // order of output channels
+
+  int mask;                       // mask the mapping below is built for
+  int nch;
+  int src[NCHANNELS];             // input channel for each output channel
+  sample_t src_gain[NCHANNELS];   // gain for each output channel
+
+  bool simd;                      // use the SIMD kernel
+  std::vector<int32_t> tmp;       // block of integer samples per channel
+  std::vector<uint8_t> buf;       // output data
+
+  void build_map(int new_mask)
+  {
+    int i, j;
+    mask = new_mask;
+    nch = 0;
+    for (i = 0; i < CH_NAMES; i++)
+    {
+      int ch = out_order[i];
+      if (!(mask & CH_MASK(ch)))
+        continue;
+
+      // Position of the channel in the input
+      int pos = 0;
+      for (j = 0; j < CH_NAMES && in_order[j] != ch; j++)
+        if (mask & CH_MASK(in_order[j]))
+          pos++;
+
+      src[nch] = pos;
+      src_gain[nch] = gains[ch];
+      nch++;
+    }
+  }
+
+  void convert(const sample_t *in, sample_t gain, int32_t *out, size_t n) const
+  {
+#ifdef TOOLS_SSE2
+    if (simd)
+    {
+      convert_sse2(in, gain, lo, hi, out, n);
+      return;
+    }
+#endif
+    convert_c(in, gain, lo, hi, out, n);
+  }
+
+public:
+  /////////////////////////////////////////////////////////
+  // Block kernels: scale, clip and round a block of samples
+
+  static void convert_c(const sample_t *in, sample_t gain, sample_t lo, sample_t hi, int32_t *out, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      sample_t v = in[i] * gain;
+      if (v < lo) v = lo;
+      if (v > hi) v = hi;
+      out[i] = int32_t(floor(v + 0.5));
+    }
+  }
+
+#ifdef TOOLS_SSE2
+  static void convert_sse2(const sample_t *in, sample_t gain, sample_t lo, sample_t hi, int32_t *out, size_t n)
+  {
+    size_t i = 0;
+    __m128d g = _mm_set1_pd(gain);
+    __m128d l = _mm_set1_pd(lo);
+    __m128d h = _mm_set1_pd(hi);
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128d a = _mm_loadu_pd(in + i);
+      __m128d b = _mm_loadu_pd(in + i + 2);
+      a = _mm_min_pd(_mm_max_pd(_mm_mul_pd(a, g), l), h);
+      b = _mm_min_pd(_mm_max_pd(_mm_mul_pd(b, g), l), h);
+      __m128i ia = floor_half_sse2(a);
+      __m128i ib = floor_half_sse2(b);
+      _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi64(ia, ib));
+    }
+    convert_c(in + i, gain, lo, hi, out + i, n - i);
+  }
+
+  // floor(v + 0.5) as convert_c does. SSE2 has no floor: truncate, and step
+  // down where truncation went up (negative values). Truncation does not
+  // depend on the rounding mode (MXCSR).
+  static __m128i floor_half_sse2(__m128d v)
+  {
+    const __m128d one = _mm_set1_pd(1.0);
+    v = _mm_add_pd(v, _mm_set1_pd(0.5));
+    __m128d t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(v));
+    t = _mm_sub_pd(t, _mm_and_pd(_mm_cmpgt_pd(t, v), one));
+    return _mm_cvttpd_epi32(t);
+  }
+#endif
+
+  /////////////////////////////////////////////////////////
+
+  static bool is_supported(int format)
+  {
+    return format == FORMAT_PCM16 || format == FORMAT_PCM24 || format == FORMAT_PCM32 ||
+           format == FORMAT_PCMFLOAT || format == FORMAT_PCMDOUBLE;
+  }
+
+  PCMPacker(): format(FORMAT_UNKNOWN), sample_size(0), lo(0), hi(0), mask(0), nch(0),
+  simd(cpu_features().sse2)
+  {
+    for (int i = 0; i < CH_NAMES; i++)
+    {
+      gains[i] = 1.0;
+      in_order[i] = out_order[i] = i;
+    }
+  }
+
+  bool init(int new_format, const sample_t new_gains[CH_NAMES],
+    const int new_in_order[CH_NAMES], const int new_out_order[CH_NAMES])
+  {
+    switch (new_format)
+    {
+      case FORMAT_PCM16:     sample_size = 2; lo = -32768.0;      hi = 32767.0;      break;
+      case FORMAT_PCM24:     sample_size = 3; lo = -8388608.0;    hi = 8388607.0;    break;
+      case FORMAT_PCM32:     sample_size = 4; lo = -2147483648.0; hi = 2147483647.0; break;
+      case FORMAT_PCMFLOAT:  sample_size = 4; break;
+      case FORMAT_PCMDOUBLE: sample_size = 8; break;
+      default: return false;
+    }
+
+    format = new_format;
+    memcpy(gains, new_gains, sizeof(gains));
+    memcpy(in_order, new_in_order, sizeof(in_order));
+    memcpy(out_order, new_out_order, sizeof(out_order));
+    mask = 0;
+    nch = 0;
+    return true;
+  }
+
+  // Use the SIMD kernel when the CPU supports it (default) or force C
+  void set_simd(bool use_simd) { simd = use_simd && cpu_features().sse2; }
+  bool get_simd() const { return simd; }
+
+  // Output format for the linear format given
+  Speakers get_output(Speakers spk) const
+  { return Speakers(format, spk.mask, spk.sample_rate, spk.level); }
+
+  // Pack a linear chunk. Output points to the internal buffer valid
+  // until the next call.
+  void pack(Speakers spk, const Chunk &in, Chunk &out)
+  {
+    size_t i, n;
+    int ch;
+
+    if (spk.mask != mask)
+      build_map(spk.mask);
+
+    size_t size = in.size;
+    if (buf.size() < size * nch * sample_size)
+      buf.resize(size * nch * sample_size);
+    if (tmp.size() < block_size * nch)
+      tmp.resize(block_size * nch);
+
+    uint8_t *dst = size? &buf[0]: 0;
+
+    if (format == FORMAT_PCMFLOAT || format == FORMAT_PCMDOUBLE)
+    {
+      for (ch = 0; ch < nch; ch++)
+      {
+        const sample_t *s = in.samples[src[ch]];
+        sample_t g = src_gain[ch];
+        if (format == FORMAT_PCMFLOAT)
+        {
+          float *d = (float *)dst + ch;
+          for (i = 0; i < size; i++, d += nch)
+            *d = float(s[i] * g);
+        }
+        else
+        {
+          double *d = (double *)dst + ch;
+          for (i = 0; i < size; i++, d += nch)
+            *d = double(s[i] * g);
+        }
+      }
+      out.set_rawdata(dst, size * nch * sample_size, in.sync, in.time);
+      return;
+    }
+
+    for (size_t pos = 0; pos < size; pos += n)
+    {
+      n = size - pos < block_size? size - pos: block_size;
+      for (ch = 0; ch < nch; ch++)
+        convert(in.samples[src[ch]] + pos, src_gain[ch], &tmp[ch * block_size], n);
+
+      for (ch = 0; ch < nch; ch++)
+      {
+        const int32_t *t = &tmp[ch * block_size];
+        switch (format)
+        {
+          case FORMAT_PCM16:
+          {
+            int16_t *d = (int16_t *)dst + pos * nch + ch;
+            for (i = 0; i < n; i++, d += nch)
+              *d = int16_t(t[i]);
+            break;
+          }
+
+          case FORMAT_PCM24:
+          {
+            uint8_t *d = dst + (pos * nch + ch) * 3;
+            for (i = 0; i < n; i++, d += nch * 3)
+            {
+              d[0] = uint8_t(t[i]);
+              d[1] = uint8_t(t[i] >> 8);
+              d[2] = uint8_t(t[i] >> 16);
+            }
+            break;
+          }
+
+          case FORMAT_PCM32:
+          {
+            int32_t *d = (int32_t *)dst + pos * nch + ch;
+            for (i = 0; i < n; i++, d += nch)
+              *d = t[i];
+            break;
+          }
+        }
+      }
+    }
+    out.set_rawdata(dst, size * nch * sample_size, in.sync, in.time);
+  }
+};
+
+#endif
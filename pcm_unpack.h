@@ -0,0 +1,292 @@
+/******************************************************************************
+PCMUnpacker: fused input stage, the reverse of PCMPacker. Converts
+interleaved PCM into planar linear samples in one pass: channel reordering,
+deinterleaving and conversion to sample_t are done together.
+
+This replaces Converter one for one: the planar output is still written to
+the own buffer of the unpacker and the next filter copies it as it would
+copy the Converter output, so no copy of the signal is saved; the gain is
+from the single pass and the block kernel.
+
+Input channel order is given at init() (win_order for WAV files), output is
+in the standard channel order. Samples keep the scale of the format (as
+Converter does), so the output level is the level of the input.
+
+Integer formats are converted in short blocks: a block is deinterleaved
+and sign-extended per channel into a small buffer that stays in the cache,
+then converted to sample_t into the output. The block kernel is chosen at
+runtime: SSE2 when the CPU has it, C otherwise. Both are exact, so the
+output does not depend on the kernel.
+
+Chunks may end in the middle of a sample (block reads of a file), the
+partial sample is kept until the next chunk.
+
+Supported formats: PCM16, PCM24, PCM32 (little endian), PCM Float and
+PCM Double.
+******************************************************************************/
+
+#ifndef TOOLS_PCM_UNPACK_H
+#define TOOLS_PCM_UNPACK_H
+
+#include <string.h>
+#include <vector>
+#include "filter.h"
+#include "cpu_features.h"
+
+class PCMUnpacker
+{
+protected:
+  enum { block_size = 256 };
+
+  int in_order[CH_NAMES];         // order of input channels
+  int out_order[CH_NAMES];        // order of output channels
+
+  int format;                     // format the mapping below is built for
+  int mask;
+  int nch;
+  int sample_size;
+  size_t frame_size;              // size of a sample of all channels
+  int src[NCHANNELS];             // input channel for each output channel
+
+  bool simd;                      // use the SIMD kernel
+  std::vector<int32_t> tmp;       // block of integer samples per channel
+  std::vector<sample_t> buf;      // output data, channel after channel
+  size_t buf_samples;             // buffer size per channel
+
+  uint8_t part[NCHANNELS * 8];    // partial sample from the previous chunk
+  size_t part_size;
+
+  void build_map(Speakers spk)
+  {
+    int i, j;
+    format = spk.format;
+    mask = spk.mask;
+    sample_size = 0;
+    switch (format)
+    {
+      case FORMAT_PCM16:     sample_size = 2; break;
+      case FORMAT_PCM24:     sample_size = 3; break;
+      case FORMAT_PCM32:     sample_size = 4; break;
+      case FORMAT_PCMFLOAT:  sample_size = 4; break;
+      case FORMAT_PCMDOUBLE: sample_size = 8; break;
+    }
+
+    nch = 0;
+    for (i = 0; i < CH_NAMES; i++)
+    {
+      int ch = out_order[i];
+      if (!(mask & CH_MASK(ch)))
+        continue;
+
+      // Position of the channel in the input
+      int pos = 0;
+      for (j = 0; j < CH_NAMES && in_order[j] != ch; j++)
+        if (mask & CH_MASK(in_order[j]))
+          pos++;
+
+      src[nch] = pos;
+      nch++;
+    }
+
+    frame_size = nch * sample_size;
+    part_size = 0;
+
+    // Layout of the output buffer depends on the number of channels
+    buf_samples = 0;
+  }
+
+  void convert(const int32_t *in, sample_t *out, size_t n) const
+  {
+#ifdef TOOLS_SSE2
+    if (simd)
+    {
+      convert_sse2(in, out, n);
+      return;
+    }
+#endif
+    convert_c(in, out, n);
+  }
+
+  // Unpack whole samples into the output buffer at the position given
+  void unpack_samples(const uint8_t *in, size_t size, size_t out_pos)
+  {
+    size_t i, n;
+    int ch;
+
+    if (!size)
+      return;
+
+    if (format == FORMAT_PCMFLOAT || format == FORMAT_PCMDOUBLE)
+    {
+      for (ch = 0; ch < nch; ch++)
+      {
+        sample_t *d = &buf[ch * buf_samples + out_pos];
+        if (format == FORMAT_PCMFLOAT)
+        {
+          const float *s = (const float *)in + src[ch];
+          for (i = 0; i < size; i++, s += nch)
+            d[i] = sample_t(*s);
+        }
+        else
+        {
+          const double *s = (const double *)in + src[ch];
+          for (i = 0; i < size; i++, s += nch)
+            d[i] = sample_t(*s);
+        }
+      }
+      return;
+    }
+
+    for (size_t pos = 0; pos < size; pos += n)
+    {
+      n = size - pos < block_size? size - pos: block_size;
+      for (ch = 0; ch < nch; ch++)
+      {
+        int32_t *t = &tmp[ch * block_size];
+        switch (format)
+        {
+          case FORMAT_PCM16:
+          {
+            const int16_t *s = (const int16_t *)in + pos * nch + src[ch];
+            for (i = 0; i < n; i++, s += nch)
+              t[i] = *s;
+            break;
+          }
+
+          case FORMAT_PCM24:
+          {
+            const uint8_t *s = in + (pos * nch + src[ch]) * 3;
+            for (i = 0; i < n; i++, s += nch * 3)
+              t[i] = int32_t(uint32_t(s[0]) << 8 | uint32_t(s[1]) << 16 | uint32_t(s[2]) << 24) >> 8;
+            break;
+          }
+
+          case FORMAT_PCM32:
+          {
+            const int32_t *s = (const int32_t *)in + pos * nch + src[ch];
+            for (i = 0; i < n; i++, s += nch)
+              t[i] = *s;
+            break;
+          }
+        }
+      }
+
+      for (ch = 0; ch < nch; ch++)
+        convert(&tmp[ch * block_size], &buf[ch * buf_samples + out_pos + pos], n);
+    }
+  }
+
+public:
+  /////////////////////////////////////////////////////////
+  // Block kernels: integer samples to sample_t
+
+  static void convert_c(const int32_t *in, sample_t *out, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+      out[i] = sample_t(in[i]);
+  }
+
+#ifdef TOOLS_SSE2
+  static void convert_sse2(const int32_t *in, sample_t *out, size_t n)
+  {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+      _mm_storeu_pd(out + i, _mm_cvtepi32_pd(v));
+      _mm_storeu_pd(out + i + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+    }
+    convert_c(in + i, out + i, n - i);
+  }
+#endif
+
+  /////////////////////////////////////////////////////////
+
+  static bool is_supported(int format)
+  {
+    return format == FORMAT_PCM16 || format == FORMAT_PCM24 || format == FORMAT_PCM32 ||
+           format == FORMAT_PCMFLOAT || format == FORMAT_PCMDOUBLE;
+  }
+
+  PCMUnpacker(): format(FORMAT_UNKNOWN), mask(0), nch(0), sample_size(0), frame_size(0),
+  simd(cpu_features().sse2), buf_samples(0), part_size(0)
+  {
+    for (int i = 0; i < CH_NAMES; i++)
+      in_order[i] = out_order[i] = i;
+  }
+
+  void init(const int new_in_order[CH_NAMES], const int new_out_order[CH_NAMES])
+  {
+    memcpy(in_order, new_in_order, sizeof(in_order));
+    memcpy(out_order, new_out_order, sizeof(out_order));
+    format = FORMAT_UNKNOWN;
+    mask = 0;
+    nch = 0;
+    part_size = 0;
+  }
+
+  // Use the SIMD kernel when the CPU supports it (default) or force C
+  void set_simd(bool use_simd) { simd = use_simd && cpu_features().sse2; }
+  bool get_simd() const { return simd; }
+
+  // Drop the partial sample (new stream or seek)
+  void reset() { part_size = 0; }
+
+  // Linear format for the PCM format given
+  Speakers get_output(Speakers spk) const
+  { return Speakers(FORMAT_LINEAR, spk.mask, spk.sample_rate, spk.level); }
+
+  // Unpack a PCM chunk. Output points to the internal buffer valid until
+  // the next call, it is empty when the chunk has no whole sample.
+  void unpack(Speakers spk, const Chunk &in, Chunk &out)
+  {
+    if (spk.format != format || spk.mask != mask)
+      build_map(spk);
+
+    const uint8_t *data = in.rawdata;
+    size_t size = in.size;
+    size_t samples = (part_size + size) / frame_size;
+
+    if (buf_samples < samples || buf.size() < buf_samples * nch)
+    {
+      if (buf_samples < samples)
+        buf_samples = samples;
+      buf.resize(buf_samples * nch);
+    }
+    if (tmp.size() < size_t(block_size * nch))
+      tmp.resize(block_size * nch);
+
+    // Complete the partial sample
+    size_t out_pos = 0;
+    if (part_size)
+    {
+      size_t n = frame_size - part_size;
+      if (n > size)
+        n = size;
+      memcpy(part + part_size, data, n);
+      part_size += n;
+      data += n;
+      size -= n;
+      if (part_size < frame_size)
+      {
+        out.set_linear(samples_t(), 0, in.sync, in.time);
+        return;
+      }
+      unpack_samples(part, 1, 0);
+      part_size = 0;
+      out_pos = 1;
+    }
+
+    size_t n = size / frame_size;
+    unpack_samples(data, n, out_pos);
+    part_size = size - n * frame_size;
+    memcpy(part, data + n * frame_size, part_size);
+
+    samples_t out_samples;
+    for (int ch = 0; ch < nch; ch++)
+      out_samples[ch] = samples? &buf[ch * buf_samples]: 0;
+    out.set_linear(out_samples, samples, in.sync, in.time);
+  }
+};
+
+#endif
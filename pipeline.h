@@ -0,0 +1,425 @@
+/******************************************************************************
+Pipeline helpers: worker threads and bounded chunk queues used to run
+processing stages (parser, decoder, sink) in parallel.
+
+A chunk put into a queue is copied into a queue slot, so the producer may
+reuse its buffers immediately. Slots are reused, so after the first few
+chunks the queue works without memory allocations.
+
+Queues are single producer / single consumer. Any side may abort the queue
+(on error), this wakes up both sides and makes all further calls fail.
+******************************************************************************/
+
+#ifndef TOOLS_PIPELINE_H
+#define TOOLS_PIPELINE_H
+
+#include <windows.h>
+#include <process.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "filter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// PipeLock - critical section
+
+class PipeLock
+{
+protected:
+  CRITICAL_SECTION cs;
+
+public:
+  PipeLock()  { InitializeCriticalSection(&cs); }
+  ~PipeLock() { DeleteCriticalSection(&cs); }
+
+  void lock()   { EnterCriticalSection(&cs); }
+  void unlock() { LeaveCriticalSection(&cs); }
+};
+
+class PipeAutoLock
+{
+protected:
+  PipeLock *pipe_lock;
+
+public:
+  PipeAutoLock(PipeLock *pipe_lock_): pipe_lock(pipe_lock_) { pipe_lock->lock(); }
+  ~PipeAutoLock() { pipe_lock->unlock(); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// PipeThread - worker thread
+//
+// Override process() to do the job. Exceptions thrown from process() are
+// caught and saved, so the owner can report the error after wait(). When
+// process() fails, on_error() is called to abort queues the thread works
+// with, so other stages do not wait forever.
+//
+// The owner must wait() for the thread before the destruction.
+
+class PipeThread
+{
+protected:
+  HANDLE thread;
+  std::string err;
+
+  virtual void process() = 0;
+  virtual void on_error() {}
+
+  static unsigned __stdcall thread_proc(void *param)
+  {
+    PipeThread *self = (PipeThread *)param;
+    try
+    {
+      self->process();
+    }
+    catch (ValibException &e)
+    {
+      self->err = boost::diagnostic_information(e);
+      self->on_error();
+    }
+    catch (...)
+    {
+      self->err = "unknown exception";
+      self->on_error();
+    }
+    return 0;
+  }
+
+public:
+  PipeThread(): thread(0) {}
+  virtual ~PipeThread() { wait(); }
+
+  bool start()
+  {
+    if (thread) return false;
+    err.clear();
+    thread = (HANDLE)_beginthreadex(0, 0, thread_proc, this, 0, 0);
+    return thread != 0;
+  }
+
+  void wait()
+  {
+    if (!thread) return;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = 0;
+  }
+
+  bool failed() const { return !err.empty(); }
+  const std::string &error() const { return err; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ChunkCopy - queue slot, the chunk with its own copy of the data
+
+class ChunkCopy
+{
+protected:
+  std::vector<uint8_t>  raw;
+  std::vector<sample_t> linear;
+
+public:
+  Chunk    chunk;      // points to the data stored at the slot
+  Speakers spk;        // format of the chunk
+  bool     new_stream; // the chunk starts a new stream
+  bool     eos;        // end of data marker (no chunk)
+
+  // Source position at the moment the chunk was produced (for statistics)
+  double   pos;
+  int      frames;
+
+  ChunkCopy(): new_stream(false), eos(false), pos(0), frames(0) {}
+
+  // Copy the data, not the pointers
+  ChunkCopy(const ChunkCopy &other):
+  new_stream(false), eos(false), pos(0), frames(0)
+  { *this = other; }
+
+  ChunkCopy &operator =(const ChunkCopy &other)
+  {
+    if (this == &other) return *this;
+    set(other.spk, other.chunk, other.new_stream);
+    eos = other.eos;
+    pos = other.pos;
+    frames = other.frames;
+    return *this;
+  }
+
+  void set(Speakers new_spk, const Chunk &in, bool is_new_stream)
+  {
+    spk = new_spk;
+    new_stream = is_new_stream;
+    eos = false;
+
+    if (spk.format == FORMAT_LINEAR)
+    {
+      int nch = spk.nch();
+      if (linear.size() < nch * in.size)
+        linear.resize(nch * in.size);
+
+      samples_t samples;
+      for (int ch = 0; ch < nch; ch++)
+      {
+        samples[ch] = in.size? &linear[ch * in.size]: 0;
+        if (in.size)
+          memcpy(samples[ch], in.samples[ch], in.size * sizeof(sample_t));
+      }
+      chunk.set_linear(samples, in.size, in.sync, in.time);
+    }
+    else
+    {
+      if (raw.size() < in.size)
+        raw.resize(in.size);
+      if (in.size)
+        memcpy(&raw[0], in.rawdata, in.size);
+      chunk.set_rawdata(in.size? &raw[0]: 0, in.size, in.sync, in.time);
+    }
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ChunkQueue - bounded single producer / single consumer queue
+//
+// Producer:
+//   ChunkCopy *slot = queue.begin_write(); // wait for a free slot
+//   slot->set(...);                       // fill the slot
+//   queue.end_write();                    // pass it to the consumer
+//   ...
+//   queue.put_eos();                      // no more data
+//
+// Consumer:
+//   while ((slot = queue.begin_read()) != 0) // wait for data
+//   {
+//     ... use slot->chunk ...
+//     queue.end_read();                      // release the slot
+//   }
+//
+// begin_write() and begin_read() return null when the queue is aborted.
+// begin_read() also returns null at the end of data.
+
+class ChunkQueue
+{
+protected:
+  std::vector<ChunkCopy> slots;
+  size_t rd, wr;
+  HANDLE free_sem;
+  HANDLE data_sem;
+  volatile LONG aborted;
+
+public:
+  ChunkQueue(size_t size): slots(size), rd(0), wr(0), aborted(0)
+  {
+    free_sem = CreateSemaphore(0, (LONG)size, 0x7fffffff, 0);
+    data_sem = CreateSemaphore(0, 0, 0x7fffffff, 0);
+  }
+
+  ~ChunkQueue()
+  {
+    CloseHandle(free_sem);
+    CloseHandle(data_sem);
+  }
+
+  ChunkCopy *begin_write()
+  {
+    WaitForSingleObject(free_sem, INFINITE);
+    if (aborted) return 0;
+    return &slots[wr];
+  }
+
+  void end_write()
+  {
+    wr = (wr + 1) % slots.size();
+    ReleaseSemaphore(data_sem, 1, 0);
+  }
+
+  bool put(Speakers spk, const Chunk &chunk, bool new_stream)
+  {
+    ChunkCopy *slot = begin_write();
+    if (!slot) return false;
+    slot->set(spk, chunk, new_stream);
+    end_write();
+    return true;
+  }
+
+  bool put_eos()
+  {
+    ChunkCopy *slot = begin_write();
+    if (!slot) return false;
+    slot->eos = true;
+    end_write();
+    return true;
+  }
+
+  ChunkCopy *begin_read()
+  {
+    WaitForSingleObject(data_sem, INFINITE);
+    if (aborted) return 0;
+    if (slots[rd].eos)
+    {
+      // Keep the marker so repeated calls return null too
+      ReleaseSemaphore(data_sem, 1, 0);
+      return 0;
+    }
+    return &slots[rd];
+  }
+
+  void end_read()
+  {
+    rd = (rd + 1) % slots.size();
+    ReleaseSemaphore(free_sem, 1, 0);
+  }
+
+  void abort()
+  {
+    InterlockedExchange(&aborted, 1);
+    ReleaseSemaphore(free_sem, (LONG)slots.size() + 1, 0);
+    ReleaseSemaphore(data_sem, (LONG)slots.size() + 1, 0);
+  }
+
+  bool is_aborted() const
+  { return aborted != 0; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// PoolJob, JobPool - process independent jobs at several threads
+//
+// Workers take jobs in order of submission. To get results in order, wait
+// for jobs in the same order (the waiting side works as a reorder buffer).
+// PoolJob::run() receives the index of the worker thread, so a job may use
+// per-thread resources (decoders, encoders, etc).
+//
+// Exceptions thrown from run() are caught and saved at the job.
+
+class JobPool;
+
+class PoolJob
+{
+protected:
+  friend class JobPool;
+  HANDLE done;
+  std::string err;
+
+public:
+  PoolJob()          { done = CreateEvent(0, TRUE, TRUE, 0); }
+  virtual ~PoolJob() { CloseHandle(done); }
+
+  virtual void run(int worker) = 0;
+
+  bool failed() const { return !err.empty(); }
+  const std::string &error() const { return err; }
+};
+
+class PoolWorker : public PipeThread
+{
+protected:
+  JobPool *pool;
+  int index;
+  void process();
+
+public:
+  PoolWorker(JobPool *pool_, int index_): pool(pool_), index(index_) {}
+};
+
+class JobPool
+{
+protected:
+  friend class PoolWorker;
+
+  std::vector<PoolWorker *> workers;
+  std::deque<PoolJob *> jobs;
+  PipeLock jobs_lock;
+  HANDLE jobs_sem;
+
+  void work(int index)
+  {
+    while (true)
+    {
+      WaitForSingleObject(jobs_sem, INFINITE);
+
+      PoolJob *job = 0;
+      {
+        PipeAutoLock lock(&jobs_lock);
+        if (jobs.empty()) return; // stop() wakes us up without a job
+        job = jobs.front();
+        jobs.pop_front();
+      }
+
+      try
+      {
+        job->run(index);
+      }
+      catch (ValibException &e)
+      {
+        job->err = boost::diagnostic_information(e);
+      }
+      catch (...)
+      {
+        job->err = "unknown exception";
+      }
+      SetEvent(job->done);
+    }
+  }
+
+public:
+  JobPool()  { jobs_sem = CreateSemaphore(0, 0, 0x7fffffff, 0); }
+  ~JobPool() { stop(); CloseHandle(jobs_sem); }
+
+  int threads() const
+  { return (int)workers.size(); }
+
+  bool start(int nthreads)
+  {
+    stop();
+    for (int i = 0; i < nthreads; i++)
+    {
+      workers.push_back(new PoolWorker(this, i));
+      if (!workers.back()->start())
+      {
+        stop();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Finish submitted jobs and stop worker threads
+  void stop()
+  {
+    if (workers.empty()) return;
+
+    ReleaseSemaphore(jobs_sem, (LONG)workers.size(), 0);
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+      workers[i]->wait();
+      delete workers[i];
+    }
+    workers.clear();
+
+    while (WaitForSingleObject(jobs_sem, 0) == WAIT_OBJECT_0)
+      continue;
+  }
+
+  void submit(PoolJob *job)
+  {
+    job->err.clear();
+    ResetEvent(job->done);
+    {
+      PipeAutoLock lock(&jobs_lock);
+      jobs.push_back(job);
+    }
+    ReleaseSemaphore(jobs_sem, 1, 0);
+  }
+
+  // Wait for the job. Returns false when the job has failed.
+  bool wait(PoolJob *job)
+  {
+    WaitForSingleObject(job->done, INFINITE);
+    return job->err.empty();
+  }
+};
+
+inline void PoolWorker::process()
+{ pool->work(index); }
+
+#endif
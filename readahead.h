@@ -0,0 +1,175 @@
+/******************************************************************************
+ReadAhead: background thread that reads the file ahead of the parser.
+
+FileParser reads the file synchronously, so each buffer refill waits for the
+disk (or the network). ReadAhead opens the same file for sequential access
+and keeps reading up to a window ahead of the position reported by the
+owner with update(). The data read is dropped: it stays in the system file
+cache, so the parser reads of this part of the file do not wait for the
+device.
+
+When the reported position jumps (seek), read-ahead restarts from the new
+position.
+******************************************************************************/
+
+#ifndef TOOLS_READAHEAD_H
+#define TOOLS_READAHEAD_H
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include "auto_file.h"
+#include "pipeline.h"
+
+class ReadAhead : protected PipeThread
+{
+protected:
+  HANDLE   file;
+  fsize_t  file_size;
+  size_t   window;         // how far to read ahead
+  size_t   block;          // size of a single read
+  std::vector<uint8_t> buf;
+
+  PipeLock lock;
+  fsize_t  consumer_pos;   // position of the owner
+  fsize_t  ahead_pos;      // position of the read-ahead
+  bool     waiting;
+
+  HANDLE wake;
+  volatile LONG stop;
+
+  // File names are UTF-8 (args_utf8)
+  static std::wstring utf8_to_wide(const char *str)
+  {
+    int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, 0, 0);
+    if (len <= 0) return std::wstring();
+    std::vector<wchar_t> buf(len);
+    MultiByteToWideChar(CP_UTF8, 0, str, -1, &buf[0], len);
+    return std::wstring(&buf[0]);
+  }
+
+  void process()
+  {
+    fsize_t pos = 0;
+    while (!stop)
+    {
+      lock.lock();
+      fsize_t consumer = consumer_pos;
+      lock.unlock();
+
+      // Follow seeks
+      if (pos < consumer || pos > consumer + window)
+      {
+        LARGE_INTEGER new_pos;
+        new_pos.QuadPart = consumer;
+        if (!SetFilePointerEx(file, new_pos, 0, FILE_BEGIN))
+          return;
+        pos = consumer;
+      }
+
+      DWORD n = 0;
+      if (pos < file_size && pos < consumer + window)
+        if (!ReadFile(file, &buf[0], (DWORD)block, &n, 0))
+          n = 0;
+
+      if (n)
+      {
+        pos += n;
+        lock.lock();
+        ahead_pos = pos;
+        lock.unlock();
+        continue;
+      }
+
+      // Far enough ahead or at the end of the file
+      lock.lock();
+      waiting = true;
+      lock.unlock();
+      WaitForSingleObject(wake, 50);
+      lock.lock();
+      waiting = false;
+      lock.unlock();
+    }
+  }
+
+public:
+  ReadAhead(): file(INVALID_HANDLE_VALUE), file_size(0), window(0), block(0),
+  consumer_pos(0), ahead_pos(0), waiting(false), stop(0)
+  {
+    wake = CreateEvent(0, FALSE, FALSE, 0);
+  }
+
+  ~ReadAhead()
+  {
+    close();
+    CloseHandle(wake);
+  }
+
+  bool open(const char *filename, size_t window_ = 16 * 1024 * 1024, size_t block_ = 1024 * 1024)
+  {
+    close();
+
+    file = CreateFileW(utf8_to_wide(filename).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+      close();
+      return false;
+    }
+
+    file_size = size.QuadPart;
+    window = window_;
+    block = block_ < window_? block_: window_;
+    buf.resize(block);
+    consumer_pos = 0;
+    ahead_pos = 0;
+    waiting = false;
+
+    stop = 0;
+    if (!start())
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if (file == INVALID_HANDLE_VALUE)
+      return;
+
+    InterlockedExchange(&stop, 1);
+    SetEvent(wake);
+    wait();
+
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+  }
+
+  bool is_open() const { return file != INVALID_HANDLE_VALUE; }
+  fsize_t get_size() const { return file_size; }
+
+  // Position of the owner in the file. Wakes up the thread when it waits
+  // and less than a half of the window is read ahead.
+  void update(fsize_t pos)
+  {
+    if (file == INVALID_HANDLE_VALUE)
+      return;
+
+    lock.lock();
+    consumer_pos = pos;
+    bool wake_up = waiting && ahead_pos < file_size &&
+      (ahead_pos < pos || ahead_pos - pos < window / 2);
+    lock.unlock();
+
+    if (wake_up)
+      SetEvent(wake);
+  }
+};
+
+#endif
@@ -0,0 +1,504 @@
+/******************************************************************************
+Shared memory ring: pass audio data to another process without files.
+
+ShmSink writes data into a ring buffer in a named shared memory section,
+ShmSource reads it in another process. The ring carries packets:
+
+  format packet: new format of the data (Speakers)
+  data packet:   raw data of the current format
+
+so format changes are ordered with the data. Only one writer and one reader
+are supported. The writer creates the section and waits for free space when
+the ring is full; the reader waits for the section to be created and for the
+data to come. Signalling is done with named events.
+
+Waits are timed: each side keeps the process id of the other one in the
+header and stops waiting when this process is gone (so a crashed peer does
+not hang the other side), and the reader gives up when no data comes for
+the data timeout. The process of the other side is opened once and polled.
+
+The writer fails to create a ring when the section with this name exists
+already (another writer, or a reader still holding an old ring), so a live
+ring is never set up anew under its writer and reader.
+
+Names of kernel objects are built from the ring name given by the user:
+Local\valib_shm_<name> for the section and *_data, *_space for the events.
+******************************************************************************/
+
+#ifndef TOOLS_SHM_RING_H
+#define TOOLS_SHM_RING_H
+
+#include <windows.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "sink.h"
+#include "source.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// ShmRing - shared memory section with the ring
+
+class ShmRing
+{
+protected:
+  enum { version = 2 };
+  enum { packet_format = 1, packet_data = 2 };
+
+  struct Header
+  {
+    char     magic[4];          // "VSHR"
+    int32_t  version;
+    uint32_t size;              // ring data size (power of 2)
+    volatile LONG write_pos;    // bytes written (wraps around)
+    volatile LONG read_pos;     // bytes read (wraps around)
+    volatile LONG writer_done;  // no more data
+    volatile LONG reader_closed;
+    volatile LONG writer_pid;
+    volatile LONG reader_pid;   // 0 until the reader opens the ring
+  };
+
+  struct Packet
+  {
+    uint32_t type;
+    uint32_t size;              // payload size
+  };
+
+  struct FormatPacket
+  {
+    int32_t format;
+    int32_t mask;
+    int32_t sample_rate;
+    double  level;
+  };
+
+  HANDLE mapping;
+  HANDLE data_event;
+  HANDLE space_event;
+  Header *header;
+  uint8_t *data;
+
+  mutable HANDLE peer;          // process of the other side
+  mutable LONG peer_pid;        // id the handle above is opened for
+  mutable bool peer_exited;     // no process with this id
+
+  static std::string object_name(const char *name, const char *suffix)
+  { return std::string("Local\\valib_shm_") + name + suffix; }
+
+  uint32_t used() const
+  { return uint32_t((ULONG)header->write_pos - (ULONG)header->read_pos); }
+
+  // Process of the other side (id given) has exited. The process is opened
+  // when the id is seen first, later calls only poll the handle.
+  bool peer_gone(LONG pid) const
+  {
+    if (!pid)
+      return false;
+
+    if (pid != peer_pid)
+    {
+      close_peer();
+      peer_pid = pid;
+      peer = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+      peer_exited = !peer && GetLastError() == ERROR_INVALID_PARAMETER; // no such process
+    }
+
+    if (peer_exited)
+      return true;
+    return peer && WaitForSingleObject(peer, 0) == WAIT_OBJECT_0;
+  }
+
+  void close_peer() const
+  {
+    if (peer) CloseHandle(peer);
+    peer = 0;
+    peer_pid = 0;
+    peer_exited = false;
+  }
+
+  bool map(bool create, const char *name, uint32_t size)
+  {
+    std::string mapping_name = object_name(name, "");
+    size_t total = sizeof(Header) + size;
+
+    if (create)
+    {
+      mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0, (DWORD)total, mapping_name.c_str());
+      if (mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+      {
+        // The ring is in use, do not touch it
+        CloseHandle(mapping);
+        mapping = 0;
+      }
+    }
+    else
+      mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mapping_name.c_str());
+    if (!mapping)
+      return false;
+
+    header = (Header *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    data_event = CreateEventA(0, FALSE, FALSE, object_name(name, "_data").c_str());
+    space_event = CreateEventA(0, FALSE, FALSE, object_name(name, "_space").c_str());
+    if (!header || !data_event || !space_event)
+    {
+      unmap();
+      return false;
+    }
+
+    data = (uint8_t *)(header + 1);
+    return true;
+  }
+
+  void unmap()
+  {
+    if (header)      UnmapViewOfFile(header);
+    if (mapping)     CloseHandle(mapping);
+    if (data_event)  CloseHandle(data_event);
+    if (space_event) CloseHandle(space_event);
+    mapping = data_event = space_event = 0;
+    header = 0;
+    data = 0;
+    close_peer();
+  }
+
+  // Copy data into the ring at the write position (the space must be free)
+  void put(const void *buf, uint32_t size)
+  {
+    uint32_t pos = (ULONG)header->write_pos & (header->size - 1);
+    uint32_t n = header->size - pos;
+    if (n > size) n = size;
+    memcpy(data + pos, buf, n);
+    memcpy(data, (const uint8_t *)buf + n, size - n);
+    MemoryBarrier();
+    InterlockedExchangeAdd(&header->write_pos, (LONG)size);
+  }
+
+  // Copy data from the ring at the read position (the data must be there)
+  void get(void *buf, uint32_t size)
+  {
+    uint32_t pos = (ULONG)header->read_pos & (header->size - 1);
+    uint32_t n = header->size - pos;
+    if (n > size) n = size;
+    memcpy(buf, data + pos, n);
+    memcpy((uint8_t *)buf + n, data, size - n);
+    MemoryBarrier();
+    InterlockedExchangeAdd(&header->read_pos, (LONG)size);
+  }
+
+public:
+  ShmRing(): mapping(0), data_event(0), space_event(0), header(0), data(0),
+  peer(0), peer_pid(0), peer_exited(false)
+  {}
+
+  virtual ~ShmRing()
+  { unmap(); }
+
+  bool is_mapped() const
+  { return header != 0; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ShmSink - writer side
+
+class ShmSink : public Sink, public ShmRing
+{
+protected:
+  Speakers spk;
+
+  // Wait for free space in the ring. Fails when the reader is gone.
+  bool wait_space(uint32_t size)
+  {
+    while (header->size - used() < size)
+    {
+      if (header->reader_closed || peer_gone(header->reader_pid))
+        return false;
+      WaitForSingleObject(space_event, 100);
+    }
+    return true;
+  }
+
+  bool write_packet(uint32_t type, const void *payload, uint32_t size)
+  {
+    Packet p = { type, size };
+    if (!wait_space(sizeof(p) + size))
+      return false;
+    put(&p, sizeof(p));
+    put(payload, size);
+    SetEvent(data_event);
+    return true;
+  }
+
+public:
+  ShmSink()
+  {}
+
+  ~ShmSink()
+  { close_ring(); }
+
+  // Create the ring. Size is rounded up to a power of 2. Fails when a ring
+  // with this name exists already.
+  bool open_ring(const char *name, uint32_t size = 4 * 1024 * 1024)
+  {
+    close_ring();
+
+    uint32_t n = 4096;
+    while (n < size) n *= 2;
+    if (!map(true, name, n))
+      return false;
+
+    header->version = version;
+    header->size = n;
+    header->write_pos = 0;
+    header->read_pos = 0;
+    header->writer_done = 0;
+    header->reader_closed = 0;
+    header->writer_pid = (LONG)GetCurrentProcessId();
+    header->reader_pid = 0;
+
+    // Magic is set last: the reader checks it to see that the header is
+    // ready
+    MemoryBarrier();
+    memcpy(header->magic, "VSHR", 4);
+    return true;
+  }
+
+  // Mark the end of data and wait for the reader to take it
+  void close_ring()
+  {
+    if (!is_mapped())
+      return;
+
+    InterlockedExchange(&header->writer_done, 1);
+    SetEvent(data_event);
+    while (used() && !header->reader_closed && !peer_gone(header->reader_pid))
+      WaitForSingleObject(space_event, 100);
+    unmap();
+  }
+
+  /////////////////////////////////////////////////////////
+  // Sink interface
+
+  virtual bool can_open(Speakers new_spk) const
+  { return new_spk.format != FORMAT_UNKNOWN && new_spk.format != FORMAT_LINEAR; }
+
+  virtual bool open(Speakers new_spk)
+  {
+    if (!is_mapped() || !can_open(new_spk))
+      return false;
+
+    FormatPacket f = { new_spk.format, new_spk.mask, new_spk.sample_rate, new_spk.level };
+    if (!write_packet(packet_format, &f, sizeof(f)))
+      return false;
+
+    spk = new_spk;
+    return true;
+  }
+
+  virtual void close()
+  { spk = Speakers(); }
+
+  virtual void reset()
+  {}
+
+  virtual void process(const Chunk &chunk)
+  {
+    if (!is_mapped() || spk.format == FORMAT_UNKNOWN)
+      return;
+
+    // Large chunks are split, so a packet always fits the ring
+    const uint8_t *p = chunk.rawdata;
+    size_t size = chunk.size;
+    uint32_t max_size = header->size / 2;
+    while (size)
+    {
+      uint32_t n = size > max_size? max_size: (uint32_t)size;
+      if (!write_packet(packet_data, p, n))
+        return;
+      p += n;
+      size -= n;
+    }
+  }
+
+  virtual void flush()
+  {}
+
+  virtual bool is_open() const
+  { return spk.format != FORMAT_UNKNOWN; }
+
+  virtual Speakers get_input() const
+  { return spk; }
+
+  bool reader_gone() const
+  { return is_mapped() && (header->reader_closed != 0 || peer_gone(header->reader_pid)); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ShmSource - reader side
+
+class ShmSource : public Source, public ShmRing
+{
+protected:
+  Speakers spk;
+  bool format_change;     // format packet received, data not taken yet
+  bool is_new_stream;     // last chunk is the first chunk of the format
+  std::vector<uint8_t> buf;
+  DWORD data_timeout;     // ms without data to give up after
+
+  // Wait for the data. Fails at the end of data, when the writer is gone
+  // or no data comes for the data timeout.
+  bool wait_data(uint32_t size)
+  {
+    if (size > header->size)
+      return false;
+
+    DWORD start = GetTickCount();
+    uint32_t last_used = used();
+    while (used() < size)
+    {
+      if (header->writer_done && used() < size)
+        return false;
+      if (peer_gone(header->writer_pid) && used() < size)
+        return false;
+
+      // Timeout restarts when some data comes
+      if (used() != last_used)
+      {
+        last_used = used();
+        start = GetTickCount();
+      }
+      else if (GetTickCount() - start > data_timeout)
+        return false;
+
+      WaitForSingleObject(data_event, 100);
+    }
+    return true;
+  }
+
+public:
+  ShmSource(): format_change(false), is_new_stream(false), data_timeout(30000)
+  {}
+
+  // Time without data to treat the writer as stalled (ms)
+  void set_data_timeout(DWORD timeout) { data_timeout = timeout; }
+  DWORD get_data_timeout() const { return data_timeout; }
+
+  ~ShmSource()
+  { close(); }
+
+  // Open the ring created by the writer. Waits for the writer up to the
+  // timeout given (ms).
+  bool open(const char *name, DWORD timeout = 10000)
+  {
+    close();
+
+    // The writer may have created the section but not set the header up
+    // yet: retry until the header is valid.
+    DWORD start = GetTickCount();
+    while (true)
+    {
+      if (map(false, name, 0))
+      {
+        MemoryBarrier();
+        if (memcmp(header->magic, "VSHR", 4) == 0 && header->version == version)
+          break;
+        unmap();
+      }
+
+      if (GetTickCount() - start > timeout)
+        return false;
+      Sleep(10);
+    }
+    InterlockedExchange(&header->reader_pid, (LONG)GetCurrentProcessId());
+
+    // The first packet must be the format
+    Packet p;
+    FormatPacket f;
+    if (!wait_data(sizeof(p)))
+    {
+      close();
+      return false;
+    }
+    get(&p, sizeof(p));
+    if (p.type != packet_format || p.size != sizeof(f) || !wait_data(sizeof(f)))
+    {
+      close();
+      return false;
+    }
+    get(&f, sizeof(f));
+    SetEvent(space_event);
+
+    spk = Speakers(f.format, f.mask, f.sample_rate, f.level);
+    format_change = true;
+    is_new_stream = false;
+    return true;
+  }
+
+  void close()
+  {
+    if (!is_mapped())
+      return;
+
+    InterlockedExchange(&header->reader_closed, 1);
+    SetEvent(space_event);
+    unmap();
+  }
+
+  /////////////////////////////////////////////////////////
+  // Source interface
+
+  virtual void reset()
+  {}
+
+  virtual bool get_chunk(Chunk &chunk)
+  {
+    if (!is_mapped())
+      return false;
+
+    Packet p;
+    while (wait_data(sizeof(p)))
+    {
+      // Packet larger than the ring is a broken stream
+      get(&p, sizeof(p));
+      if (p.size > header->size - sizeof(p) || !wait_data(p.size))
+        return false;
+
+      if (p.type == packet_format && p.size == sizeof(FormatPacket))
+      {
+        FormatPacket f;
+        get(&f, sizeof(f));
+        SetEvent(space_event);
+
+        Speakers new_spk(f.format, f.mask, f.sample_rate, f.level);
+        if (!(new_spk == spk))
+        {
+          spk = new_spk;
+          format_change = true;
+        }
+        continue;
+      }
+
+      if (buf.size() < p.size)
+        buf.resize(p.size);
+      if (p.size)
+        get(&buf[0], p.size);
+      SetEvent(space_event);
+
+      if (p.type != packet_data)
+        continue;
+
+      chunk.set_rawdata(p.size? &buf[0]: 0, p.size);
+      is_new_stream = format_change;
+      format_change = false;
+      return true;
+    }
+    return false;
+  }
+
+  // True when the last chunk is the first chunk after a format change
+  virtual bool new_stream() const
+  { return is_new_stream; }
+
+  virtual Speakers get_output() const
+  { return spk; }
+};
+
+#endif
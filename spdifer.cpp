@@ -14,6 +14,7 @@
 #include "sink/sink_wav.h"
 #include "vtime.h"
 #include "vargs.h"
+#include "readahead.h"
 
 #include "spdifer_usage.txt.h"
 
@@ -31,7 +32,7 @@ int spdifer_proc(const arg_list_t &args)
   WAVSink   wav;
   Sink     *sink;
 
-  if (args.size() < 3 || args.size() > 4)
+  if (args.size() < 3)
   {
     fprintf(stderr, usage);
     return 0;
@@ -43,13 +44,32 @@ int spdifer_proc(const arg_list_t &args)
   const char *input_filename = args[1].raw.c_str();
   const char *output_filename = args[2].raw.c_str();
   enum { mode_raw, mode_wav } mode = mode_raw;
+  bool use_readahead = false;
 
-  if (args.size() > 3)
+  for (size_t iarg = 3; iarg < args.size(); iarg++)
   {
-    if (args[3].is_option("raw", argt_exist))
+    const arg_t &arg = args[iarg];
+
+    if (arg.is_option("raw", argt_exist))
+    {
       mode = mode_raw;
-    if (args[3].is_option("wav", argt_exist))
+      continue;
+    }
+
+    if (arg.is_option("wav", argt_exist))
+    {
       mode = mode_wav;
+      continue;
+    }
+
+    if (arg.is_option("readahead", argt_bool))
+    {
+      use_readahead = arg.as_bool();
+      continue;
+    }
+
+    fprintf(stderr, "Error: unknown option: %s\n", arg.raw.c_str());
+    return 1;
   }
 
   /////////////////////////////////////////////////////////
@@ -62,6 +82,10 @@ int spdifer_proc(const arg_list_t &args)
     return 1;
   }
 
+  ReadAhead readahead;
+  if (use_readahead && !readahead.open(input_filename))
+    fprintf(stderr, "Warning: cannot start read-ahead for '%s'\n", input_filename);
+
   switch (mode)
   {
   case mode_wav:
@@ -103,6 +127,7 @@ int spdifer_proc(const arg_list_t &args)
   while (file.get_chunk(chunk))
   {
     frames++;
+    readahead.update(file.get_pos());
     if (file.new_stream())
     {
       Speakers new_spk = file.get_output();
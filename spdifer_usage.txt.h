@@ -8,11 +8,13 @@ const char *usage =
 "Copyright (c) 2007-2013 by Alexander Vigovsky\n"
 "\n"
 "Usage:\n"
-"  spdifer input_file output_file [-raw | -wav]\n"
+"  spdifer input_file output_file [-raw | -wav] [-readahead]\n"
 "\n"
 "Options:\n"
 "  input_file  - file to convert\n"
 "  output_file - file to write result to\n"
 "  -raw - make raw SPDIF stream output (default)\n"
 "  -wav - make PCM WAV file with SPDIF data (for writing to CD Audio)\n"
+"  -readahead - read the input file ahead at a background thread (helps\n"
+"    with slow or network storage)\n"
 ;
@@ -0,0 +1,372 @@
+/******************************************************************************
+Sequential stream input and output: pipes, stdin/stdout.
+
+StreamSource reads PCM data from a stream that cannot seek, so the size of
+the data may be unknown:
+
+  open_wav() - WAV (RIFF or RF64) stream. RIFF data chunk with zero or
+               unknown size (0 or 0xffffffff, as written by capture
+               programs that cannot update the header) is read up to the
+               end of the stream. RF64 data size is taken from the ds64
+               chunk as is (zero means unknown).
+  open_raw() - headerless PCM with the format given.
+
+Data is read in blocks of the size given, the block is reused, so memory
+use does not depend on the stream length.
+
+StreamSink writes the data to a stream and flushes it after each chunk, so
+the reader gets each chunk (i.e. each encoded frame) without a delay.
+******************************************************************************/
+
+#ifndef TOOLS_STREAM_IO_H
+#define TOOLS_STREAM_IO_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "sink.h"
+#include "source.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Open a file by UTF-8 name (as given by args_utf8)
+
+inline FILE *stream_open(const char *filename, const wchar_t *mode)
+{
+  int len = MultiByteToWideChar(CP_UTF8, 0, filename, -1, 0, 0);
+  if (len <= 0) return 0;
+  std::vector<wchar_t> buf(len);
+  MultiByteToWideChar(CP_UTF8, 0, filename, -1, &buf[0], len);
+  return _wfopen(&buf[0], mode);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StreamSource
+
+class StreamSource : public Source
+{
+protected:
+  FILE *f;
+  bool own_file;
+
+  Speakers spk;
+  size_t block_samples;       // samples per block
+  std::vector<uint8_t> buf;
+  bool first_chunk;
+  bool is_new_stream;
+
+  bool limited;               // data size is known
+  uint64_t data_left;
+
+  static int sample_size(int format)
+  {
+    switch (format)
+    {
+      case FORMAT_PCM16:
+      case FORMAT_PCM16_BE:  return 2;
+      case FORMAT_PCM24:
+      case FORMAT_PCM24_BE:  return 3;
+      case FORMAT_PCM32:
+      case FORMAT_PCM32_BE:
+      case FORMAT_PCMFLOAT:  return 4;
+      case FORMAT_PCMDOUBLE: return 8;
+    }
+    return 0;
+  }
+
+  static uint32_t le32(const uint8_t *p)
+  { return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24; }
+
+  static uint16_t le16(const uint8_t *p)
+  { return uint16_t(p[0] | p[1] << 8); }
+
+  // Channel mask of WAVEFORMATEXTENSIBLE to the channel mask
+  static int wav_mask(uint32_t wav)
+  {
+    int mask = 0;
+    if (wav & 0x001) mask |= CH_MASK_L;
+    if (wav & 0x002) mask |= CH_MASK_R;
+    if (wav & 0x004) mask |= CH_MASK_C;
+    if (wav & 0x008) mask |= CH_MASK_LFE;
+    if (wav & 0x040) mask |= CH_MASK_CL;
+    if (wav & 0x080) mask |= CH_MASK_CR;
+    if (wav & 0x100) mask |= CH_MASK_BC;
+    if (wav & 0x200) mask |= CH_MASK_SL;
+    if (wav & 0x400) mask |= CH_MASK_SR;
+
+    // Back channels are surround channels unless both are present
+    if (wav & 0x010) mask |= (wav & 0x200)? CH_MASK_BL: CH_MASK_SL;
+    if (wav & 0x020) mask |= (wav & 0x400)? CH_MASK_BR: CH_MASK_SR;
+    return mask;
+  }
+
+  // Default channel mask for the number of channels
+  static int default_mask(int nch)
+  {
+    static const int masks[] = { 0, MODE_MONO, MODE_STEREO, MODE_3_0, MODE_QUADRO, MODE_3_2, MODE_5_1, MODE_6_1, MODE_7_1 };
+    return nch > 0 && nch < int(sizeof(masks) / sizeof(masks[0]))? masks[nch]: 0;
+  }
+
+  bool read(void *data, size_t size)
+  { return fread(data, 1, size, f) == size; }
+
+  bool skip(uint64_t size)
+  {
+    uint8_t tmp[4096];
+    while (size)
+    {
+      size_t n = size > sizeof(tmp)? sizeof(tmp): size_t(size);
+      if (!read(tmp, n))
+        return false;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool parse_fmt(const uint8_t *fmt, size_t size)
+  {
+    if (size < 16)
+      return false;
+
+    int tag = le16(fmt);
+    int nch = le16(fmt + 2);
+    int sample_rate = int(le32(fmt + 4));
+    int bits = le16(fmt + 14);
+    int mask = default_mask(nch);
+
+    // WAVE_FORMAT_EXTENSIBLE: mask and subformat
+    if (tag == 0xfffe && size >= 40)
+    {
+      uint32_t wav = le32(fmt + 20);
+      if (wav)
+        mask = wav_mask(wav);
+      tag = le16(fmt + 24);
+    }
+
+    int format = FORMAT_UNKNOWN;
+    if (tag == 1 && bits == 16) format = FORMAT_PCM16;
+    if (tag == 1 && bits == 24) format = FORMAT_PCM24;
+    if (tag == 1 && bits == 32) format = FORMAT_PCM32;
+    if (tag == 3 && bits == 32) format = FORMAT_PCMFLOAT;
+    if (tag == 3 && bits == 64) format = FORMAT_PCMDOUBLE;
+
+    if (format == FORMAT_UNKNOWN || !mask || !sample_rate)
+      return false;
+
+    spk = Speakers(format, mask, sample_rate);
+    return spk.nch() == nch;
+  }
+
+  bool init(Speakers new_spk, size_t new_block_samples)
+  {
+    if (!sample_size(new_spk.format) || !new_spk.mask || !new_spk.sample_rate)
+      return false;
+
+    spk = new_spk;
+    block_samples = new_block_samples;
+    buf.resize(block_samples * sample_size(spk.format) * spk.nch());
+    first_chunk = true;
+    is_new_stream = false;
+    return true;
+  }
+
+public:
+  StreamSource(): f(0), own_file(false), block_samples(0),
+  first_chunk(false), is_new_stream(false), limited(false), data_left(0)
+  {}
+
+  ~StreamSource()
+  { close(); }
+
+  // Open a WAV stream. Reads the header up to the start of the data.
+  bool open_wav(FILE *new_f, bool own, size_t new_block_samples = 1536)
+  {
+    close();
+    f = new_f;
+    own_file = own;
+
+    uint8_t riff[12];
+    if (!read(riff, 12) ||
+        (memcmp(riff, "RIFF", 4) && memcmp(riff, "RF64", 4)) ||
+        memcmp(riff + 8, "WAVE", 4))
+    {
+      close();
+      return false;
+    }
+    bool rf64 = memcmp(riff, "RF64", 4) == 0;
+    uint64_t rf64_data_size = 0;
+    bool have_fmt = false;
+
+    while (true)
+    {
+      uint8_t hdr[8];
+      if (!read(hdr, 8))
+        break;
+      uint32_t size = le32(hdr + 4);
+
+      if (!memcmp(hdr, "data", 4))
+      {
+        if (!have_fmt || !init(spk, new_block_samples))
+          break;
+
+        // Zero or unknown size: read up to the end of the stream. Only the
+        // 32bit RIFF field has the 0xffffffff mark, RF64 size is 64bit.
+        if (rf64 && size == 0xffffffff)
+        {
+          limited = rf64_data_size != 0;
+          data_left = rf64_data_size;
+        }
+        else
+        {
+          limited = size != 0 && size != 0xffffffff;
+          data_left = size;
+        }
+        return true;
+      }
+
+      if (!memcmp(hdr, "fmt ", 4) && size < 1024)
+      {
+        uint8_t fmt[1024];
+        if (!read(fmt, size + (size & 1)) || !parse_fmt(fmt, size))
+          break;
+        have_fmt = true;
+        continue;
+      }
+
+      if (!memcmp(hdr, "ds64", 4) && size >= 28 && size < 1024)
+      {
+        uint8_t ds64[1024];
+        if (!read(ds64, size + (size & 1)))
+          break;
+        rf64_data_size = uint64_t(le32(ds64 + 8)) | uint64_t(le32(ds64 + 12)) << 32;
+        continue;
+      }
+
+      // Skip other chunks (with the pad byte)
+      if (!skip(uint64_t(size) + (size & 1)))
+        break;
+    }
+
+    close();
+    return false;
+  }
+
+  // Open headerless PCM stream of the format given
+  bool open_raw(FILE *new_f, bool own, Speakers new_spk, size_t new_block_samples = 1536)
+  {
+    close();
+    f = new_f;
+    own_file = own;
+    limited = false;
+    data_left = 0;
+    if (!init(new_spk, new_block_samples))
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if (f && own_file)
+      fclose(f);
+    f = 0;
+    own_file = false;
+    spk = Speakers();
+  }
+
+  bool is_open() const { return f != 0; }
+
+  /////////////////////////////////////////////////////////
+  // Source interface
+
+  virtual void reset()
+  {}
+
+  virtual bool get_chunk(Chunk &chunk)
+  {
+    if (!f || (limited && !data_left))
+      return false;
+
+    size_t size = buf.size();
+    if (limited && data_left < size)
+      size = size_t(data_left);
+
+    size = fread(&buf[0], 1, size, f);
+    if (!size)
+      return false;
+    if (limited)
+      data_left -= size;
+
+    chunk.set_rawdata(&buf[0], size);
+    is_new_stream = first_chunk;
+    first_chunk = false;
+    return true;
+  }
+
+  virtual bool new_stream() const
+  { return is_new_stream; }
+
+  virtual Speakers get_output() const
+  { return spk; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// StreamSink
+
+class StreamSink : public Sink
+{
+protected:
+  FILE *f;
+  Speakers spk;
+
+public:
+  StreamSink(): f(0)
+  {}
+
+  void open_stream(FILE *new_f)
+  { f = new_f; }
+
+  /////////////////////////////////////////////////////////
+  // Sink interface
+
+  virtual bool can_open(Speakers new_spk) const
+  { return f != 0 && new_spk.format != FORMAT_UNKNOWN && new_spk.format != FORMAT_LINEAR; }
+
+  virtual bool open(Speakers new_spk)
+  {
+    if (!can_open(new_spk))
+      return false;
+    spk = new_spk;
+    return true;
+  }
+
+  virtual void close()
+  { spk = Speakers(); }
+
+  virtual void reset()
+  {}
+
+  virtual void process(const Chunk &chunk)
+  {
+    if (!f || !chunk.size)
+      return;
+    fwrite(chunk.rawdata, 1, chunk.size, f);
+    fflush(f);
+  }
+
+  virtual void flush()
+  {
+    if (f)
+      fflush(f);
+  }
+
+  virtual bool is_open() const
+  { return f != 0; }
+
+  virtual Speakers get_input() const
+  { return spk; }
+};
+
+#endif
@@ -0,0 +1,148 @@
+/******************************************************************************
+TruePeakMeter: true (inter-sample) peak of linear data, as in ITU-R BS.1770
+annex 2: the signal is oversampled 4 times and the peak of the oversampled
+signal is taken, so peaks between samples that appear after the conversion
+to analog (or after resampling) are counted.
+
+Interpolation filter is a Hann-windowed sinc, 12 taps per phase, with the
+gain of each phase normalized to 1. Original samples are measured as is, so
+the true peak is never below the sample peak.
+
+Data is processed with the delay of a half of the filter: the last samples
+of a chunk are measured with the next chunk, or by finish() at the end of
+the stream. Each sample may be excluded from the measurement (it still
+feeds the filter), so the measurement may be limited to a range of samples.
+******************************************************************************/
+
+#ifndef TOOLS_TRUE_PEAK_H
+#define TOOLS_TRUE_PEAK_H
+
+#include <math.h>
+#include <vector>
+#include "filter.h"
+
+class TruePeakMeter
+{
+protected:
+  enum { over = 4 };          // oversampling factor
+  enum { half = 6 };          // taps at each side of the point
+  enum { taps = half * 2 };   // taps per phase
+
+  sample_t coef[over][taps];
+  int nch;
+  std::vector<sample_t> buf[NCHANNELS];   // history and the new data
+  std::vector<uint8_t> measured;           // sample is measured
+  sample_t peak;
+
+  void measure_point(const sample_t *s, sample_t &p) const
+  {
+    // s points to the first tap: interpolated points are between
+    // s[half - 1] and s[half]
+    sample_t v = s[half - 1] < 0? -s[half - 1]: s[half - 1];
+    if (v > p) p = v;
+
+    for (int phase = 1; phase < over; phase++)
+    {
+      const sample_t *c = coef[phase];
+      sample_t sum = 0;
+      for (int i = 0; i < taps; i++)
+        sum += s[i] * c[i];
+      if (sum < 0) sum = -sum;
+      if (sum > p) p = sum;
+    }
+  }
+
+  void init_history()
+  {
+    // Zeros before the stream start, so the first samples are measured
+    for (int ch = 0; ch < NCHANNELS; ch++)
+      buf[ch].assign(taps - 1, 0);
+    measured.assign(taps - 1, 0);
+  }
+
+public:
+  TruePeakMeter(): nch(0), peak(0)
+  {
+    const double pi = 3.14159265358979323846;
+    for (int phase = 0; phase < over; phase++)
+    {
+      double sum = 0;
+      for (int i = 0; i < taps; i++)
+      {
+        // Distance from the tap to the interpolated point (in samples)
+        double d = double(i - half + 1) - double(phase) / over;
+        double sinc = d == 0? 1.0: sin(pi * d) / (pi * d);
+        double window = 0.5 + 0.5 * cos(pi * d / half);
+        coef[phase][i] = sample_t(sinc * window);
+        sum += sinc * window;
+      }
+      for (int i = 0; i < taps; i++)
+        coef[phase][i] = sample_t(coef[phase][i] / sum);
+    }
+    init_history();
+  }
+
+  // New stream: drop the history, keep the peak
+  void reset()
+  {
+    nch = 0;
+    init_history();
+  }
+
+  sample_t get_peak() const { return peak; }
+
+  // Process a chunk, measure samples [from, to) of it
+  void process(Speakers spk, const Chunk &chunk, size_t from, size_t to)
+  {
+    if (spk.nch() != nch)
+    {
+      reset();
+      nch = spk.nch();
+    }
+    if (!chunk.size)
+      return;
+
+    for (size_t i = 0; i < chunk.size; i++)
+      measured.push_back(i >= from && i < to);
+
+    size_t end = measured.size();
+    for (int ch = 0; ch < nch; ch++)
+    {
+      std::vector<sample_t> &b = buf[ch];
+      b.insert(b.end(), chunk.samples[ch], chunk.samples[ch] + chunk.size);
+
+      // Points with the full filter support: b[m - half + 1 .. m + half]
+      sample_t p = peak;
+      for (size_t m = half - 1; m + half < end; m++)
+        if (measured[m])
+          measure_point(&b[m - half + 1], p);
+      peak = p;
+
+      b.erase(b.begin(), b.end() - (taps - 1));
+    }
+    measured.erase(measured.begin(), measured.end() - (taps - 1));
+  }
+
+  // End of the stream: measure the delayed samples
+  void finish()
+  {
+    if (!nch)
+      return;
+
+    size_t end = measured.size() + half;
+    for (int ch = 0; ch < nch; ch++)
+    {
+      std::vector<sample_t> &b = buf[ch];
+      b.insert(b.end(), half, 0);
+
+      sample_t p = peak;
+      for (size_t m = half - 1; m + half < end; m++)
+        if (m < measured.size() && measured[m])
+          measure_point(&b[m - half + 1], p);
+      peak = p;
+    }
+    reset();
+  }
+};
+
+#endif
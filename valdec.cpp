@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <conio.h>
 #include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
 #include <string>
 
 // parsers
@@ -19,12 +22,22 @@
 #include "sink/sink_null.h"
 
 // filters
+#include "filters/convert.h"
 #include "filters/dvd_graph.h"
 
 // other
 #include "win32/cpu.h"
 #include "vargs.h"
 #include "log.h"
+#include "async_log.h"
+#include "frame_index.h"
+#include "pcm_pack.h"
+#include "level_meter.h"
+#include "pipeline.h"
+#include "readahead.h"
+#include "hash_sink.h"
+#include "true_peak.h"
+#include "shm_ring.h"
 
 #include "valdec_usage.txt.h"
 
@@ -126,9 +139,1809 @@ const enum_opt log_level_tbl[] =
   { "all",       log_all       },
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Pipeline stages for -threads mode:
+// FileParser -> [queue] -> DVDGraph -> [queue] -> Sink (main thread)
+///////////////////////////////////////////////////////////////////////////////
+
+class ParserThread : public PipeThread
+{
+protected:
+  FileParser *file;
+  ChunkQueue *out;
+  bool print_info;
+
+  PipeLock info_lock;
+  std::vector<std::string> info;
+
+  void process()
+  {
+    Chunk chunk;
+    while (file->get_chunk(chunk))
+    {
+      bool new_stream = file->new_stream();
+      if (new_stream)
+      {
+        streams++;
+        if (print_info && streams > 1)
+        {
+          PipeAutoLock lock(&info_lock);
+          info.push_back(file->stream_info());
+        }
+      }
+
+      ChunkCopy *slot = out->begin_write();
+      if (!slot) return;
+      slot->set(file->get_output(), chunk, new_stream);
+      slot->pos = file->get_pos(file->relative);
+      slot->frames = file->get_frames();
+      out->end_write();
+    }
+    out->put_eos();
+  }
+
+  void on_error()
+  { out->abort(); }
+
+public:
+  int streams;
+
+  ParserThread(FileParser *file_, ChunkQueue *out_, bool print_info_):
+  file(file_), out(out_), print_info(print_info_), streams(0)
+  {}
+
+  // Stream info of new streams found (for -i option)
+  bool get_info(std::string &stream_info)
+  {
+    PipeAutoLock lock(&info_lock);
+    if (info.empty()) return false;
+    stream_info = info.front();
+    info.erase(info.begin());
+    return true;
+  }
+};
+
+class GraphThread : public PipeThread
+{
+protected:
+  Filter *graph;
+  ChunkQueue *in;
+  ChunkQueue *out;
+
+  double pos;
+  int frames;
+
+  bool put(const Chunk &chunk)
+  {
+    ChunkCopy *slot = out->begin_write();
+    if (!slot) return false;
+    slot->set(graph->get_output(), chunk, graph->new_stream());
+    slot->pos = pos;
+    slot->frames = frames;
+    out->end_write();
+    return true;
+  }
+
+  void process()
+  {
+    Chunk chunk, out_chunk;
+    ChunkCopy *slot;
+    while ((slot = in->begin_read()) != 0)
+    {
+      chunk = slot->chunk;
+      pos = slot->pos;
+      frames = slot->frames;
+
+      while (graph->process(chunk, out_chunk))
+        if (!put(out_chunk))
+          return;
+
+      in->end_read();
+    }
+
+    if (in->is_aborted())
+      return;
+
+    while (graph->flush(out_chunk))
+      if (!put(out_chunk))
+        return;
+
+    out->put_eos();
+  }
+
+  void on_error()
+  {
+    in->abort();
+    out->abort();
+  }
+
+public:
+  GraphThread(Filter *graph_, ChunkQueue *in_, ChunkQueue *out_):
+  graph(graph_), in(in_), out(out_), pos(0), frames(0)
+  {}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame-parallel decoding for -dec_threads mode
+//
+// Frames are grouped into jobs and decoded to linear format by a pool of
+// decoders. Decoders are not stateless (overlapped transforms, bit reservoir),
+// so each job starts with a few last frames of the previous job (preroll) to
+// bring the decoder to the state of the serial decoder. Output of the preroll
+// frames is dropped. Jobs are returned in order, so stateful processing
+// (mixer, AGC, delay) is done serially after the decoder.
+///////////////////////////////////////////////////////////////////////////////
+
+// Decoder keeps a graph for each of a few last input formats, so switching
+// between formats (AC3 <-> DTS in SPDIF captures) resets a ready graph
+// instead of building a new one.
+
+class FrameDecoder
+{
+protected:
+  struct CacheEntry
+  {
+    DVDGraph *graph;
+    Speakers  spk;    // format the graph is open for
+    int       used;   // last use time
+  };
+
+  std::vector<CacheEntry> cache;
+  size_t max_graphs;
+  int clock;
+
+  static DVDGraph *new_graph()
+  {
+    // Decode only, no processing
+    DVDGraph *g = new DVDGraph;
+    g->proc.set_auto_gain(false);
+    g->proc.set_normalize(false);
+    g->proc.set_drc(false);
+    g->set_user(Speakers(FORMAT_LINEAR, 0, 0));
+    return g;
+  }
+
+public:
+  DVDGraph *graph;    // current graph
+  Speakers spk;       // current input format
+
+  // Graphs are created on demand, so an unused decoder is cheap
+  FrameDecoder(size_t max_graphs_ = 4):
+  max_graphs(max_graphs_ > 0? max_graphs_: 1), clock(0), graph(0)
+  {}
+
+  ~FrameDecoder()
+  {
+    for (size_t i = 0; i < cache.size(); i++)
+      delete cache[i].graph;
+  }
+
+  // Prepare to decode a new run of frames
+  bool start(Speakers new_spk)
+  {
+    size_t i;
+    clock++;
+    for (i = 0; i < cache.size(); i++)
+      if (cache[i].spk == new_spk)
+      {
+        cache[i].used = clock;
+        graph = cache[i].graph;
+        graph->reset();
+        spk = new_spk;
+        return true;
+      }
+
+    // Take a new graph or the least recently used one
+    if (cache.size() < max_graphs)
+    {
+      CacheEntry e = { new_graph(), Speakers(), 0 };
+      cache.push_back(e);
+    }
+
+    size_t lru = cache.size() - 1;
+    for (i = 0; i < cache.size(); i++)
+      if (cache[i].used < cache[lru].used)
+        lru = i;
+
+    CacheEntry &e = cache[lru];
+    e.spk = Speakers();
+    e.used = clock;
+    graph = e.graph;
+    spk = Speakers();
+    if (!graph->open(new_spk))
+      return false;
+
+    e.spk = new_spk;
+    spk = new_spk;
+    return true;
+  }
+};
+
+class DecodeJob : public PoolJob
+{
+protected:
+  std::vector<FrameDecoder *> *decoders;
+
+  void put(Speakers spk, const Chunk &chunk)
+  {
+    if (nout == out.size())
+      out.resize(nout + 1);
+    out[nout++].set(spk, chunk, false);
+  }
+
+public:
+  Speakers spk;                  // input format
+  std::vector<ChunkCopy> frames; // frames to decode
+  size_t nframes;                // number of frames used
+  size_t preroll;                // number of preroll frames
+  bool end_of_stream;            // flush the decoder after the last frame
+
+  bool new_stream;               // the job starts a new stream
+  std::string stream_info;       // info of the new stream (-i option)
+  double pos;                    // file position after the last frame
+  int file_frames;               // frames parsed after the last frame
+
+  std::vector<ChunkCopy> out;    // decoded chunks
+  size_t nout;                   // number of decoded chunks
+
+  DecodeJob(std::vector<FrameDecoder *> *decoders_):
+  decoders(decoders_)
+  { clear(); }
+
+  void clear()
+  {
+    nframes = 0;
+    preroll = 0;
+    end_of_stream = false;
+    new_stream = false;
+    stream_info.clear();
+    pos = 0;
+    file_frames = 0;
+    nout = 0;
+  }
+
+  void add_frame(const ChunkCopy &frame)
+  {
+    if (nframes == frames.size())
+      frames.resize(nframes + 1);
+    frames[nframes++] = frame;
+  }
+
+  void run(int worker)
+  {
+    FrameDecoder *dec = (*decoders)[worker];
+
+    nout = 0;
+    if (!dec->start(spk))
+    {
+      err = std::string("Unsupported format ") + spk.print();
+      return;
+    }
+
+    Chunk chunk, out_chunk;
+    for (size_t i = 0; i < nframes; i++)
+    {
+      chunk = frames[i].chunk;
+      while (dec->graph->process(chunk, out_chunk))
+        if (i >= preroll)
+          put(dec->graph->get_output(), out_chunk);
+    }
+
+    if (end_of_stream)
+      while (dec->graph->flush(out_chunk))
+        put(dec->graph->get_output(), out_chunk);
+  }
+};
+
+class ParallelDecoder
+{
+protected:
+  FileParser *file;
+  bool print_info;
+  size_t job_frames;
+
+  JobPool pool;
+  std::vector<FrameDecoder *> decoders;
+  std::vector<DecodeJob *> jobs; // ring of jobs
+
+  size_t head;         // first job in the ring
+  size_t pending;      // number of jobs submitted
+  DecodeJob *current;  // job being returned
+  size_t out_pos;      // next chunk of the current job
+  DecodeJob *last;     // last job read from the file
+
+  // Next frame of the file (look-ahead to find stream boundaries)
+  bool have_next;
+  ChunkCopy next;
+  std::string next_info;
+
+  std::vector<std::string> info;
+  std::string err;
+
+  void read_next()
+  {
+    Chunk chunk;
+    have_next = file->get_chunk(chunk);
+    if (!have_next)
+      return;
+
+    bool new_stream = file->new_stream();
+    next.set(file->get_output(), chunk, new_stream);
+    next.pos = file->get_pos(file->relative);
+    next.frames = file->get_frames();
+
+    next_info.clear();
+    if (new_stream)
+    {
+      streams++;
+      if (print_info && streams > 1)
+        next_info = file->stream_info();
+    }
+  }
+
+  // Preroll for the format: enough frames to cover the state a decoder
+  // carries from frame to frame. Conservative, unknown formats (SPDIF may
+  // carry any of them) get the maximum.
+  // MPA: layer III bit reservoir reaches 511 bytes back (MPEG-1), 255 bytes
+  //   (MPEG-2), up to ~10 of the smallest frames, plus the IMDCT overlap.
+  // AC3: MDCT overlap is one block, exponents are not shared between frames.
+  // DTS: QMF filter history (512 samples) and ADPCM prediction history.
+  static size_t preroll_frames(Speakers spk)
+  {
+    switch (spk.format)
+    {
+      case FORMAT_AC3: return 4;
+      case FORMAT_DTS: return 4;
+      case FORMAT_MPA: return 16;
+    }
+    return 16;
+  }
+
+  bool read_job(DecodeJob *job)
+  {
+    job->clear();
+    if (!have_next)
+      return false;
+
+    if (next.new_stream || !last || last->end_of_stream)
+    {
+      job->new_stream = next.new_stream;
+      job->stream_info = next_info;
+      job->spk = next.spk;
+    }
+    else
+    {
+      // A previous job shorter than the preroll starts the stream, so all
+      // of its frames give the state of the serial decoder
+      size_t n = MIN(preroll_frames(last->spk), last->nframes);
+      for (size_t i = last->nframes - n; i < last->nframes; i++)
+        job->add_frame(last->frames[i]);
+      job->preroll = n;
+      job->spk = last->spk;
+    }
+
+    do
+    {
+      job->add_frame(next);
+      job->pos = next.pos;
+      job->file_frames = next.frames;
+      read_next();
+    }
+    while (have_next && !next.new_stream && job->nframes - job->preroll < job_frames);
+
+    job->end_of_stream = !have_next || next.new_stream;
+    last = job;
+    return true;
+  }
+
+  void fill()
+  {
+    while (pending < jobs.size())
+    {
+      DecodeJob *job = jobs[(head + pending) % jobs.size()];
+      if (!read_job(job))
+        break;
+      pool.submit(job);
+      pending++;
+    }
+  }
+
+public:
+  int streams;
+  double pos;
+  int frames;
+
+  ParallelDecoder(FileParser *file_, bool print_info_, size_t job_frames_ = 32):
+  file(file_), print_info(print_info_), job_frames(job_frames_),
+  head(0), pending(0), current(0), out_pos(0), last(0), have_next(false),
+  streams(0), pos(0), frames(0)
+  {}
+
+  ~ParallelDecoder()
+  {
+    pool.stop();
+    for (size_t i = 0; i < jobs.size(); i++)
+      delete jobs[i];
+    for (size_t i = 0; i < decoders.size(); i++)
+      delete decoders[i];
+  }
+
+  bool start(int threads)
+  {
+    for (int i = 0; i < threads; i++)
+      decoders.push_back(new FrameDecoder());
+
+    // Two jobs per thread: one is being decoded, one is waiting
+    for (int i = 0; i < 2 * threads; i++)
+      jobs.push_back(new DecodeJob(&decoders));
+
+    if (!pool.start(threads))
+      return false;
+
+    read_next();
+    return true;
+  }
+
+  // Next decoded chunk in order of the file. Returns null at the end of the
+  // file or on error.
+  ChunkCopy *get_chunk()
+  {
+    while (true)
+    {
+      if (current)
+      {
+        if (out_pos < current->nout)
+          return &current->out[out_pos++];
+
+        head = (head + 1) % jobs.size();
+        pending--;
+        current = 0;
+      }
+
+      fill();
+      if (!pending)
+        return 0;
+
+      current = jobs[head];
+      if (!pool.wait(current))
+      {
+        err = current->error();
+        return 0;
+      }
+
+      out_pos = 0;
+      pos = current->pos;
+      frames = current->file_frames;
+      if (!current->stream_info.empty())
+        info.push_back(current->stream_info);
+    }
+  }
+
+  // Stream info of new streams found (for -i option)
+  bool get_info(std::string &stream_info)
+  {
+    if (info.empty()) return false;
+    stream_info = info.front();
+    info.erase(info.begin());
+    return true;
+  }
+
+  bool failed() const { return !err.empty(); }
+  const std::string &error() const { return err; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-stage profiling for -profile mode
+///////////////////////////////////////////////////////////////////////////////
+
+class Profiler
+{
+public:
+  enum stage_t { parser, decoder, processor, converter, sink, nstages };
+
+  Profiler()
+  {
+    QueryPerformanceFrequency(&freq);
+    for (int i = 0; i < nstages; i++)
+    {
+      calls[i] = 0;
+      ticks[i] = 0;
+    }
+    run_start = 0;
+    run_ticks = 0;
+  }
+
+  static const char *stage_name(int stage)
+  {
+    static const char *names[nstages] = { "parser", "decoder", "processor", "converter", "sink" };
+    return names[stage];
+  }
+
+  void start_run() { run_start = now(); }
+  void stop_run()  { run_ticks += now() - run_start; }
+
+  void begin(int stage)
+  { start[stage] = now(); }
+
+  void end(int stage)
+  {
+    ticks[stage] += now() - start[stage];
+    calls[stage]++;
+  }
+
+  bool end(int stage, bool result)
+  {
+    end(stage);
+    return result;
+  }
+
+  int    get_calls(int stage) const { return calls[stage]; }
+  double get_time(int stage)  const { return double(ticks[stage]) / double(freq.QuadPart); }
+  double get_wall_time()      const { return double(run_ticks) / double(freq.QuadPart); }
+
+  void print(FILE *f, int frames) const
+  {
+    double wall = get_wall_time();
+    double total = 0;
+
+    fprintf(f, "\nProfile:\n");
+    fprintf(f, "------------------------------------------------------------\n");
+    fprintf(f, "Stage        Calls       Time(ms)   ns/frame    Share\n");
+    for (int i = 0; i < nstages; i++)
+    {
+      double t = get_time(i);
+      total += t;
+      fprintf(f, "%-10s %8i %13.3f %10.0f %7.2f%%\n", stage_name(i), calls[i], t * 1000,
+        frames? t * 1e9 / frames: 0.0, wall > 0? t * 100 / wall: 0.0);
+    }
+    fprintf(f, "------------------------------------------------------------\n");
+    fprintf(f, "%-10s %8s %13.3f %10.0f %7.2f%%\n", "stages", "", total * 1000,
+      frames? total * 1e9 / frames: 0.0, wall > 0? total * 100 / wall: 0.0);
+    fprintf(f, "%-10s %8s %13.3f %10.0f\n", "wall", "", wall * 1000,
+      frames? wall * 1e9 / frames: 0.0);
+  }
+
+  bool write_json(const char *filename, const char *input, int frames) const
+  {
+    FILE *f = fopen(filename, "w");
+    if (!f) return false;
+
+    double wall = get_wall_time();
+    fprintf(f, "{\n");
+    fprintf(f, "  \"input\": \"");
+    for (const char *c = input; *c; c++)
+      if (*c == '"' || *c == '\\')
+        fprintf(f, "\\%c", *c);
+      else
+        fputc(*c, f);
+    fprintf(f, "\",\n");
+    fprintf(f, "  \"frames\": %i,\n", frames);
+    fprintf(f, "  \"wall_time\": %.6f,\n", wall);
+    fprintf(f, "  \"stages\": [\n");
+    for (int i = 0; i < nstages; i++)
+    {
+      double t = get_time(i);
+      fprintf(f, "    { \"name\": \"%s\", \"calls\": %i, \"time\": %.6f, \"ns_per_frame\": %.1f, \"share\": %.4f }%s\n",
+        stage_name(i), calls[i], t, frames? t * 1e9 / frames: 0.0, wall > 0? t / wall: 0.0,
+        i < nstages - 1? ",": "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+    fclose(f);
+    return true;
+  }
+
+protected:
+  LARGE_INTEGER freq;
+  int     calls[nstages];
+  __int64 ticks[nstages];
+  __int64 start[nstages];
+  __int64 run_start;
+  __int64 run_ticks;
+
+  static __int64 now()
+  {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+  }
+};
+
+// ProfiledChain - filter chain that times each filter as a separate stage.
+// Works like FilterChain: process(in, out) is called until it returns false,
+// flush(out) is called at the end. Filters are opened when the format of
+// the upstream filter changes (with a flush of the old data). The first
+// filter must be opened by the caller.
+
+class ProfiledChain
+{
+protected:
+  enum state_t { state_empty, state_input, state_reopen, state_flush, state_done };
+
+  struct Node
+  {
+    Filter  *filter;
+    int      stage;
+    Chunk    in;
+    state_t  state;
+    bool     opened;
+    Speakers spk;
+  };
+
+  Profiler *profiler;
+  std::vector<Node> nodes;
+  Chunk *first_in;
+  bool eos;
+  std::string err;
+
+  bool node_process(size_t i, Chunk &out)
+  {
+    Node &n = nodes[i];
+    Chunk &in = i? n.in: *first_in;
+    profiler->begin(n.stage);
+    return profiler->end(n.stage, n.filter->process(in, out));
+  }
+
+  bool node_flush(Node &n, Chunk &out)
+  {
+    profiler->begin(n.stage);
+    return profiler->end(n.stage, n.filter->flush(out));
+  }
+
+  bool pull(size_t i, Chunk &out)
+  {
+    Node &n = nodes[i];
+    while (true)
+    {
+      switch (n.state)
+      {
+      case state_input:
+        if (node_process(i, out))
+          return true;
+        n.state = state_empty;
+        break;
+
+      case state_reopen:
+        if (node_flush(n, out))
+          return true;
+        if (!n.filter->open(n.spk))
+          return fail(n.spk);
+        n.state = state_input;
+        break;
+
+      case state_flush:
+        if (node_flush(n, out))
+          return true;
+        n.state = state_done;
+        return false;
+
+      case state_done:
+        return false;
+
+      case state_empty:
+        if (i == 0)
+        {
+          if (!eos)
+            return false;
+          n.state = state_flush;
+          break;
+        }
+
+        if (!pull(i - 1, n.in))
+        {
+          if (eos && nodes[i - 1].state == state_done)
+          {
+            n.state = n.opened? state_flush: state_done;
+            break;
+          }
+          return false;
+        }
+
+        if (!n.opened || nodes[i - 1].filter->new_stream())
+        {
+          Speakers spk = nodes[i - 1].filter->get_output();
+          if (n.opened && n.spk == spk)
+          {
+            n.state = state_input;
+            break;
+          }
+
+          n.spk = spk;
+          if (n.opened)
+          {
+            n.state = state_reopen;
+            break;
+          }
+
+          if (!n.filter->open(spk))
+            return fail(spk);
+          n.opened = true;
+        }
+        n.state = state_input;
+        break;
+      }
+    }
+  }
+
+  bool fail(Speakers spk)
+  {
+    err = std::string("Cannot open a filter with format ") + spk.print();
+    for (size_t i = 0; i < nodes.size(); i++)
+      nodes[i].state = state_done;
+    return false;
+  }
+
+public:
+  ProfiledChain(Profiler *profiler_): profiler(profiler_), first_in(0), eos(false) {}
+
+  void add_back(Filter *filter, int stage)
+  {
+    Node n;
+    n.filter = filter;
+    n.stage = stage;
+    n.state = state_empty;
+    n.opened = nodes.empty(); // the first filter is opened by the caller
+    nodes.push_back(n);
+  }
+
+  bool process(Chunk &in, Chunk &out)
+  {
+    Node &first = nodes.front();
+    if (first.state == state_empty)
+    {
+      first_in = &in;
+      first.state = state_input;
+    }
+    return pull(nodes.size() - 1, out);
+  }
+
+  bool flush(Chunk &out)
+  {
+    eos = true;
+    return pull(nodes.size() - 1, out);
+  }
+
+  bool new_stream() const
+  { return nodes.back().filter->new_stream(); }
+
+  Speakers get_output() const
+  { return nodes.back().filter->get_output(); }
+
+  bool failed() const { return !err.empty(); }
+  const std::string &error() const { return err; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Output trimming for -start/-end options
+//
+// Decoding starts a bit before the start point (preroll) to let the decoder
+// and filters reach the steady state. Output before the start point is
+// dropped. Output after the end point is dropped and processing stops.
+///////////////////////////////////////////////////////////////////////////////
+
+class OutputTrim
+{
+protected:
+  double   skip_time; // time to drop at the beginning
+  double   length;    // time to pass after that (0 - unlimited)
+  int      rate;      // sample rate the limits below are computed for
+  uint64_t skip;      // samples to drop
+  uint64_t limit;     // sample to stop at (0 - unlimited)
+  uint64_t pos;       // samples seen
+  bool     done;
+
+public:
+  OutputTrim(): skip_time(0), length(0), rate(0), skip(0), limit(0), pos(0), done(false)
+  {}
+
+  void init(double skip_time_, double length_)
+  {
+    skip_time = skip_time_ > 0? skip_time_: 0;
+    length = length_ > 0? length_: 0;
+    rate = 0;
+    pos = 0;
+    done = false;
+  }
+
+  bool is_active() const { return skip_time > 0 || length > 0; }
+  bool is_done() const { return done; }
+
+  void cut(Speakers spk, Chunk &chunk)
+  {
+    if (!is_active() || !spk.sample_rate)
+      return;
+
+    if (done)
+    {
+      chunk.size = 0;
+      return;
+    }
+
+    size_t sample_size = (spk.format == FORMAT_LINEAR)? 1: spk.nch() * spk.sample_size();
+    if (!sample_size)
+      return;
+
+    if (spk.sample_rate != rate)
+    {
+      rate = spk.sample_rate;
+      skip = uint64_t(skip_time * rate + 0.5);
+      limit = length > 0? skip + uint64_t(length * rate + 0.5): 0;
+    }
+
+    size_t n = chunk.size / sample_size;
+    uint64_t begin = pos;
+    uint64_t end = pos + n;
+    pos = end;
+
+    size_t from = (begin < skip)? size_t(MIN(skip, end) - begin): 0;
+    size_t to = n;
+    if (limit && end >= limit)
+    {
+      to = (limit > begin)? size_t(limit - begin): 0;
+      done = true;
+    }
+
+    if (to <= from)
+    {
+      chunk.size = 0;
+      return;
+    }
+
+    if (spk.format == FORMAT_LINEAR)
+      chunk.drop_samples(from);
+    else
+      chunk.rawdata += from * sample_size;
+    chunk.size = (to - from) * sample_size;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Additional outputs (tee)
+//
+// Several files may be written in one pass. The input is decoded once and
+// the decoded data goes to the main output and to each additional output.
+// Each output has its own processing graph (mixer, resampler, converter), so
+// it may have its own sample format, channel layout and sample rate.
+// Processing options (mixer, agc, delays, etc) are the same for all outputs.
+///////////////////////////////////////////////////////////////////////////////
+
+class TeeOutput
+{
+protected:
+  ChunkCopy copy;     // graph may process the data in-place
+  Speakers  in_spk;   // decoded format the graph is open for
+  Speakers  sink_spk; // format the sink is open with
+
+  bool write(Chunk &out)
+  {
+    Speakers new_spk = graph.get_output();
+    if (graph.new_stream() && !(new_spk == sink_spk))
+    {
+      if (!sink->open(new_spk))
+      {
+        fprintf(stderr, "\nOutput format %s is unsupported (%s)\n", new_spk.print().c_str(), filename);
+        return false;
+      }
+      sink_spk = new_spk;
+      fprintf(stderr, "%-77s\r", "");
+      fprintf(stderr, "Opening audio output %s (%s)...\n", new_spk.print().c_str(), filename);
+    }
+    trim.cut(graph.get_output(), out);
+    sink->process(out);
+    return true;
+  }
+
+public:
+  const char *filename;
+  bool wav_file;      // WAV or RAW output
+  int format;
+  int mask;
+  int sample_rate;
+
+  DVDGraph   graph;
+  RAWSink    raw;
+  WAVSink    wav;
+  Sink      *sink;
+  OutputTrim trim;
+
+  TeeOutput(const char *filename_, bool wav_file_):
+  filename(filename_), wav_file(wav_file_),
+  format(FORMAT_PCM16), mask(0), sample_rate(0), sink(0)
+  {}
+
+  bool open_file()
+  {
+    if (wav_file)
+    {
+      sink = &wav;
+      return wav.open_file(filename);
+    }
+    sink = &raw;
+    return raw.open_file(filename);
+  }
+
+  bool process(Speakers spk, const Chunk &chunk)
+  {
+    if (!(spk == in_spk))
+    {
+      if (!flush())
+        return false;
+
+      in_spk = Speakers();
+      if (!graph.open(spk))
+      {
+        fprintf(stderr, "\nError: unsupported decoded format %s (%s)\n", spk.print().c_str(), filename);
+        return false;
+      }
+      in_spk = spk;
+    }
+
+    copy.set(spk, chunk, false);
+    Chunk in = copy.chunk;
+    Chunk out;
+    while (graph.process(in, out))
+      if (!write(out))
+        return false;
+    return true;
+  }
+
+  bool flush()
+  {
+    if (in_spk.format == FORMAT_UNKNOWN)
+      return true;
+
+    Chunk out;
+    while (graph.flush(out))
+      if (!write(out))
+        return false;
+    return true;
+  }
+};
+
+class TeeOutputs
+{
+protected:
+  std::vector<TeeOutput *> outputs;
+
+public:
+  ~TeeOutputs()
+  {
+    for (size_t i = 0; i < outputs.size(); i++)
+      delete outputs[i];
+  }
+
+  size_t size() const { return outputs.size(); }
+  TeeOutput &operator [](size_t i) { return *outputs[i]; }
+  TeeOutput &back() { return *outputs.back(); }
+
+  void add(const char *filename, bool wav_file)
+  { outputs.push_back(new TeeOutput(filename, wav_file)); }
+
+  void init_trim(double skip_time, double length)
+  {
+    for (size_t i = 0; i < outputs.size(); i++)
+      outputs[i]->trim.init(skip_time, length);
+  }
+
+  bool process(Speakers spk, const Chunk &chunk)
+  {
+    for (size_t i = 0; i < outputs.size(); i++)
+      if (!outputs[i]->process(spk, chunk))
+        return false;
+    return true;
+  }
+
+  bool flush()
+  {
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+      if (!outputs[i]->flush())
+        return false;
+      outputs[i]->sink->flush();
+    }
+    return true;
+  }
+};
+
+// Processing options set by the command line are kept at the main graph,
+// additional outputs and scan graphs take them from there.
+static void copy_proc_options(AudioProcessor &dst, const AudioProcessor &src)
+{
+  int order[CH_NAMES];
+  sample_t gains[CH_NAMES];
+  float delays[CH_NAMES];
+  matrix_t m;
+
+  src.get_input_order(order);
+  dst.set_input_order(order);
+  src.get_output_order(order);
+  dst.set_output_order(order);
+  src.get_output_gains(gains);
+  dst.set_output_gains(gains);
+  src.get_delays(delays);
+  dst.set_delay_units(src.get_delay_units());
+  dst.set_delays(delays);
+
+  dst.set_auto_matrix(src.get_auto_matrix());
+  dst.set_normalize_matrix(src.get_normalize_matrix());
+  dst.set_voice_control(src.get_voice_control());
+  dst.set_expand_stereo(src.get_expand_stereo());
+  dst.set_clev(src.get_clev());
+  dst.set_slev(src.get_slev());
+  dst.set_lfelev(src.get_lfelev());
+  dst.set_master(src.get_master());
+  dst.set_auto_gain(src.get_auto_gain());
+  dst.set_normalize(src.get_normalize());
+  dst.set_drc(src.get_drc());
+  dst.set_drc_power(src.get_drc_power());
+  dst.set_attack(src.get_attack());
+  dst.set_release(src.get_release());
+  dst.set_delay(src.get_delay());
+
+  // Custom matrix is used only when auto matrix is off
+  if (!src.get_auto_matrix())
+  {
+    src.get_matrix(m);
+    dst.set_matrix(m);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Peak scan for two-pass normalization (-normalize2)
+//
+// The file is split into byte ranges scanned independently at the thread
+// pool. Each worker has its own file parser and processing graph with the
+// same options as the main graph, but with unity master gain, no AGC and
+// linear output (no converter, no sink). A range starts a few frames
+// earlier (preroll) to warm up the decoder and the filters; output produced
+// while processing the preroll is not measured. A frame belongs to the range
+// where it starts.
+//
+// The true peak (4x oversampled) is measured. With -start/-end only the
+// part of the file that is output is scanned: byte ranges cover the frames
+// of this part (found with the frame index) and samples outside of the time
+// limits are not measured.
+///////////////////////////////////////////////////////////////////////////////
+
+class PeakScanWorker
+{
+public:
+  UniFrameParser uni;
+  FileParser file;
+  DVDGraph graph;
+  Speakers spk;
+};
+
+class PeakScanJob : public PoolJob
+{
+protected:
+  std::vector<PeakScanWorker *> *workers;
+  TruePeakMeter meter;
+  double time;      // time of the next output sample
+
+  // Measure the part of the chunk within the time limits
+  void measure(const Speakers &out_spk, const Chunk &chunk)
+  {
+    size_t from = 0, to = chunk.size;
+    if (index && out_spk.sample_rate)
+    {
+      double rate = out_spk.sample_rate;
+      if (start_time > time)
+      {
+        double n = (start_time - time) * rate + 0.5;
+        from = n < chunk.size? size_t(n): chunk.size;
+      }
+      if (end_time > 0)
+      {
+        double n = (end_time - time) * rate + 0.5;
+        to = n <= 0? 0: n < chunk.size? size_t(n): chunk.size;
+      }
+      time += chunk.size / rate;
+    }
+    meter.process(out_spk, chunk, from, to);
+  }
+
+public:
+  fsize_t start;    // range start
+  fsize_t end;      // range end
+  fsize_t preroll;  // bytes to decode before the range
+  bool last;        // the last range (flush at the end)
+
+  const FrameIndex *index;  // frame times for the time limits (0 - no limits)
+  double start_time;        // measure from this time
+  double end_time;          // measure up to this time (0 - unlimited)
+
+  sample_t peak;    // result
+
+  PeakScanJob(std::vector<PeakScanWorker *> *workers_):
+  workers(workers_), time(0), start(0), end(0), preroll(0), last(false),
+  index(0), start_time(0), end_time(0), peak(0)
+  {}
+
+  void run(int worker)
+  {
+    PeakScanWorker *w = (*workers)[worker];
+    FileParser &file = w->file;
+    DVDGraph &graph = w->graph;
+    Chunk chunk, out;
+    bool first = true;
+    bool first_in_range = true;
+
+    peak = 0;
+    meter = TruePeakMeter();
+    file.seek(start > preroll? start - preroll: 0);
+    while (file.get_chunk(chunk))
+    {
+      fsize_t frame_pos = file.get_pos() - chunk.size;
+      if (frame_pos >= end)
+        break;
+
+      if (first)
+      {
+        Speakers spk = file.get_output();
+        if (spk == w->spk)
+          graph.reset();
+        else
+        {
+          w->spk = Speakers();
+          if (!graph.open(spk))
+            return;
+          w->spk = spk;
+        }
+        first = false;
+      }
+
+      bool in_range = frame_pos >= start;
+      if (in_range && first_in_range)
+      {
+        time = index? index->time_at(uint64_t(frame_pos)): 0;
+        first_in_range = false;
+      }
+
+      while (graph.process(chunk, out))
+        if (in_range)
+          measure(graph.get_output(), out);
+    }
+
+    if (last && !first)
+      while (graph.flush(out))
+        measure(graph.get_output(), out);
+
+    meter.finish();
+    peak = meter.get_peak();
+  }
+};
+
+// Scan the true peak of the file, or of the part between start_time and
+// end_time when the index is given.
+static bool scan_peak(const char *filename, fsize_t file_size, fsize_t frame_size,
+  const FrameIndex *index, double start_time, double end_time,
+  int threads, const AudioProcessor &proc, Speakers user_spk, sample_t &peak)
+{
+  size_t i;
+  if (threads <= 0)
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = info.dwNumberOfProcessors;
+  }
+
+  // Part of the file to scan. The end is found a second later, so the
+  // frames up to the end time are scanned (VBR index entries are 0.5s
+  // apart), samples after the end time are not measured.
+  fsize_t scan_start = 0;
+  fsize_t scan_end = file_size;
+  if (index)
+  {
+    uint64_t offset;
+    double offset_time;
+    if (start_time > 0 && index->find(start_time, offset, offset_time))
+      scan_start = fsize_t(offset);
+    if (end_time > 0 && index->find(end_time + 1.0, offset, offset_time) && fsize_t(offset) < file_size)
+      scan_end = fsize_t(offset);
+    if (scan_end < scan_start)
+      scan_end = scan_start;
+  }
+  fsize_t scan_size = scan_end - scan_start;
+
+  // Several ranges per thread to balance the load,
+  // but not too short compared to the preroll.
+  const fsize_t min_range = 256 * 1024;
+  size_t nranges = threads * 4;
+  if (scan_size / min_range < nranges)
+    nranges = size_t(scan_size / min_range);
+  if (nranges < 1)
+    nranges = 1;
+
+  std::vector<PeakScanWorker *> workers;
+  std::vector<PeakScanJob *> jobs;
+  bool ok = true;
+
+  for (i = 0; i < size_t(threads) && ok; i++)
+  {
+    PeakScanWorker *w = new PeakScanWorker;
+    workers.push_back(w);
+
+    copy_proc_options(w->graph.proc, proc);
+    w->graph.proc.set_auto_gain(false);
+    w->graph.proc.set_normalize(false);
+    w->graph.proc.set_master(1.0);
+    ok = w->graph.set_user(Speakers(FORMAT_LINEAR, user_spk.mask, user_spk.sample_rate, user_spk.level)) &&
+         w->file.open(filename, &w->uni, 1000000);
+  }
+
+  for (i = 0; i < nranges; i++)
+  {
+    PeakScanJob *job = new PeakScanJob(&workers);
+    job->start = scan_start + scan_size * i / nranges;
+    job->end = scan_start + scan_size * (i + 1) / nranges;
+    job->preroll = frame_size * 4;
+    job->last = (i == nranges - 1) && scan_end == file_size;
+    job->index = index;
+    job->start_time = start_time;
+    job->end_time = end_time;
+    jobs.push_back(job);
+  }
+
+  JobPool pool;
+  if (ok)
+    ok = pool.start(threads);
+
+  peak = 0;
+  if (ok)
+  {
+    for (i = 0; i < jobs.size(); i++)
+      pool.submit(jobs[i]);
+
+    for (i = 0; i < jobs.size(); i++)
+    {
+      if (!pool.wait(jobs[i]))
+      {
+        fprintf(stderr, "\nProcessing error: %s\n", jobs[i]->error().c_str());
+        ok = false;
+      }
+      else if (jobs[i]->peak > peak)
+        peak = jobs[i]->peak;
+
+      fprintf(stderr, "Scanning peak level: %3i%%\r", int((i + 1) * 100 / jobs.size()));
+      fflush(stderr);
+    }
+    fprintf(stderr, "\n");
+  }
+  pool.stop();
+
+  for (i = 0; i < jobs.size(); i++)
+    delete jobs[i];
+  for (i = 0; i < workers.size(); i++)
+    delete workers[i];
+  return ok;
+}
+
+// Get the next frame from the file, time the parser when profiling
+static bool get_frame(FileParser &file, Chunk &chunk, Profiler *profiler)
+{
+  if (!profiler)
+    return file.get_chunk(chunk);
+
+  profiler->begin(Profiler::parser);
+  return profiler->end(Profiler::parser, file.get_chunk(chunk));
+}
+
+static double cpu_time(const FILETIME &kernel_time, const FILETIME &user_time)
+{
+  ULARGE_INTEGER kernel, user;
+  kernel.LowPart = kernel_time.dwLowDateTime;
+  kernel.HighPart = kernel_time.dwHighDateTime;
+  user.LowPart = user_time.dwLowDateTime;
+  user.HighPart = user_time.dwHighDateTime;
+  return double(kernel.QuadPart + user.QuadPart) / 10000000;
+}
+
+// CPU time used by all threads of the process
+static double process_time()
+{
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+    return 0;
+  return cpu_time(kernel_time, user_time);
+}
+
+// CPU time used by the current thread
+static double thread_time()
+{
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+    return 0;
+  return cpu_time(kernel_time, user_time);
+}
+
+static double wall_time()
+{
+  LARGE_INTEGER freq, t;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return double(t.QuadPart) / double(freq.QuadPart);
+}
+
+// Number of samples in a chunk of PCM or linear data
+static size_t chunk_samples(Speakers spk, const Chunk &chunk)
+{
+  if (spk.format == FORMAT_LINEAR)
+    return chunk.size;
+  if (!spk.nch() || !spk.sample_size())
+    return 0;
+  return chunk.size / (spk.nch() * spk.sample_size());
+}
+
+// Duration of a chunk of PCM or linear data
+static double chunk_time(Speakers spk, const Chunk &chunk)
+{
+  if (!spk.sample_rate)
+    return 0;
+  return double(chunk_samples(spk, chunk)) / spk.sample_rate;
+}
+
+static double median(std::vector<double> values)
+{
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  size_t n = values.size();
+  return n % 2? values[n / 2]: (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Value below which the given share of values falls (values are sorted)
+static double percentile(const std::vector<double> &sorted, double share)
+{
+  if (sorted.empty()) return 0;
+  size_t i = size_t(share * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// In-memory benchmark for -bench mode
+//
+// The whole file is parsed into memory first, so the benchmark does not
+// include file reading and parsing. Each run decodes all frames from the
+// beginning with a freshly opened graph. The first run is a warm-up run and
+// is not counted.
+///////////////////////////////////////////////////////////////////////////////
+
+static void load_frames(FileParser &file, std::deque<ChunkCopy> &frames)
+{
+  Chunk chunk;
+  file.seek(0);
+  while (file.get_chunk(chunk))
+  {
+    frames.push_back(ChunkCopy());
+    frames.back().set(file.get_output(), chunk, file.new_stream());
+  }
+}
+
+static int bench(FileParser &file, DVDGraph &graph, PCMPacker *packer, int runs)
+{
+  fprintf(stderr, "Loading the file into memory...\n");
+
+  std::deque<ChunkCopy> frames;
+  Chunk chunk, out_chunk, pcm_chunk;
+
+  load_frames(file, frames);
+  if (frames.empty())
+  {
+    fprintf(stderr, "Error: no frames found\n");
+    return 1;
+  }
+  Speakers in_spk = frames.front().spk;
+
+  NullSink sink;
+  std::vector<double> run_cpu, run_fps, run_realtime;
+  std::vector<double> frame_time; // time to decode and process each frame
+  frame_time.reserve(frames.size() * runs);
+
+  for (int run = 0; run <= runs; run++)
+  {
+    if (!graph.open(in_spk))
+    {
+      fprintf(stderr, "Error: unsupported file format %s\n", in_spk.print().c_str());
+      return 1;
+    }
+
+    Speakers out_spk;
+    double duration = 0;
+    double cpu = thread_time();
+    double wall = wall_time();
+
+    for (size_t i = 0; i <= frames.size(); i++)
+    {
+      // Flush the graph after the last frame
+      bool flushing = i == frames.size();
+      if (!flushing)
+        chunk = frames[i].chunk;
+
+      double frame_start = wall_time();
+      while (flushing? graph.flush(out_chunk): graph.process(chunk, out_chunk))
+      {
+        if (graph.new_stream())
+        {
+          out_spk = graph.get_output();
+          sink.open(packer? packer->get_output(out_spk): out_spk);
+        }
+        if (out_spk.sample_rate)
+          duration += double(chunk_samples(out_spk, out_chunk)) / out_spk.sample_rate;
+        if (packer)
+        {
+          packer->pack(out_spk, out_chunk, pcm_chunk);
+          sink.process(pcm_chunk);
+        }
+        else
+          sink.process(out_chunk);
+      }
+
+      if (run > 0 && !flushing)
+        frame_time.push_back(wall_time() - frame_start);
+    }
+    sink.flush();
+
+    wall = wall_time() - wall;
+    cpu = thread_time() - cpu;
+
+    if (run == 0)
+    {
+      // Warm-up run
+      fprintf(stderr, "Frames: %i, duration: %.3fs\n", int(frames.size()), duration);
+      fprintf(stderr, "Run  Time(ms)   CPU(ms)      FPS  x Realtime\n");
+      continue;
+    }
+
+    double fps = wall > 0? frames.size() / wall: 0;
+    double realtime = wall > 0? duration / wall: 0;
+    fprintf(stderr, "%3i %9.1f %9.1f %8.0f %11.1f\n", run, wall * 1000, cpu * 1000, fps, realtime);
+
+    run_cpu.push_back(cpu);
+    run_fps.push_back(fps);
+    run_realtime.push_back(realtime);
+  }
+
+  fprintf(stderr, "---------------------------------------\n");
+  fprintf(stderr, "             min    median       max\n");
+  fprintf(stderr, "FPS   %10.0f %9.0f %9.0f\n",
+    *std::min_element(run_fps.begin(), run_fps.end()), median(run_fps),
+    *std::max_element(run_fps.begin(), run_fps.end()));
+  fprintf(stderr, "x RT  %10.1f %9.1f %9.1f\n",
+    *std::min_element(run_realtime.begin(), run_realtime.end()), median(run_realtime),
+    *std::max_element(run_realtime.begin(), run_realtime.end()));
+  fprintf(stderr, "CPU   %8.1fms %7.1fms %7.1fms\n",
+    *std::min_element(run_cpu.begin(), run_cpu.end()) * 1000, median(run_cpu) * 1000,
+    *std::max_element(run_cpu.begin(), run_cpu.end()) * 1000);
+
+  // Per-frame latency matters for real-time transcoding more than the
+  // throughput: a frame must be ready before its playback time.
+  std::sort(frame_time.begin(), frame_time.end());
+  fprintf(stderr, "Frame latency: median %.1fus, 99%% %.1fus, 99.9%% %.1fus, max %.1fus\n",
+    percentile(frame_time, 0.5) * 1e6, percentile(frame_time, 0.99) * 1e6,
+    percentile(frame_time, 0.999) * 1e6, frame_time.empty()? 0.0: frame_time.back() * 1e6);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Startup report (-startup_report)
+//
+// Time to the first output chunk split into initialization phases. Each
+// mark() ends a phase started by the previous mark. Time before valdec()
+// (process creation, loading, static initialization) is measured from the
+// process creation time.
+///////////////////////////////////////////////////////////////////////////////
+
+class StartupReport
+{
+protected:
+  enum { max_phases = 16 };
+
+  const char *names[max_phases];
+  double times[max_phases];
+  int nphases;
+  double start;      // valdec() entry
+  double preinit;    // time from the process creation to valdec() entry
+  bool   done;       // first output is done
+
+public:
+  StartupReport(): nphases(0), preinit(0), done(false)
+  {
+    start = wall_time();
+
+    FILETIME creation, exit_time, kernel_time, user_time, now;
+    if (GetProcessTimes(GetCurrentProcess(), &creation, &exit_time, &kernel_time, &user_time))
+    {
+      GetSystemTimeAsFileTime(&now);
+      ULARGE_INTEGER c, n;
+      c.LowPart = creation.dwLowDateTime;
+      c.HighPart = creation.dwHighDateTime;
+      n.LowPart = now.dwLowDateTime;
+      n.HighPart = now.dwHighDateTime;
+      if (n.QuadPart > c.QuadPart)
+        preinit = double(n.QuadPart - c.QuadPart) / 10000000.0;
+    }
+  }
+
+  void mark(const char *name)
+  {
+    if (done || nphases >= max_phases)
+      return;
+    names[nphases] = name;
+    times[nphases] = wall_time();
+    nphases++;
+  }
+
+  void first_output()
+  {
+    if (done) return;
+    mark("first output chunk");
+    done = true;
+  }
+
+  void print(FILE *f) const
+  {
+    fprintf(f, "Startup:\n");
+    fprintf(f, "  %-22s %9.3fms\n", "process start", preinit * 1000);
+
+    double prev = start;
+    for (int i = 0; i < nphases; i++)
+    {
+      fprintf(f, "  %-22s %9.3fms\n", names[i], (times[i] - prev) * 1000);
+      prev = times[i];
+    }
+    fprintf(f, "  %-22s %9.3fms\n", done? "time to first sample": "total (no output)",
+      (preinit + prev - start) * 1000);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Stream switch benchmark: frames of two files interleaved, so the format
+// changes at each frame. Frames are decoded apart from processing as in
+// -dec_threads mode, decoders are reused from the cache (the normal case)
+// or opened at each switch (cache of one graph).
+///////////////////////////////////////////////////////////////////////////////
+
+// Output of the processing graph to the sink, keep the sink open when the
+// format does not change
+static void switch_output(DVDGraph &graph, Chunk &out, NullSink &sink, Speakers &sink_spk, PCMPacker *packer)
+{
+  Chunk pcm;
+  Speakers out_spk = graph.get_output();
+  if (graph.new_stream())
+  {
+    Speakers new_spk = packer? packer->get_output(out_spk): out_spk;
+    if (!(new_spk == sink_spk))
+    {
+      sink.open(new_spk);
+      sink_spk = new_spk;
+    }
+  }
+
+  if (packer)
+  {
+    packer->pack(out_spk, out, pcm);
+    sink.process(pcm);
+  }
+  else
+    sink.process(out);
+}
+
+// Decoded data to the processing graph, reopen it at the format change
+static bool switch_process(DVDGraph &graph, Speakers spk, Chunk &in, Speakers &in_spk, NullSink &sink, Speakers &sink_spk, PCMPacker *packer)
+{
+  Chunk out;
+  if (!(spk == in_spk))
+  {
+    while (graph.flush(out))
+      switch_output(graph, out, sink, sink_spk, packer);
+
+    in_spk = Speakers();
+    if (!graph.open(spk))
+    {
+      fprintf(stderr, "Error: unsupported decoded format %s\n", spk.print().c_str());
+      return false;
+    }
+    in_spk = spk;
+  }
+
+  while (graph.process(in, out))
+    switch_output(graph, out, sink, sink_spk, packer);
+  return true;
+}
+
+static int bench_switch(FileParser &file, const char *other_filename, DVDGraph &graph, PCMPacker *packer, int runs)
+{
+  fprintf(stderr, "Loading files into memory...\n");
+
+  UniFrameParser other_uni;
+  FileParser other;
+  if (!other.open(other_filename, &other_uni, 1000000))
+  {
+    fprintf(stderr, "Error: Cannot open file '%s'\n", other_filename);
+    return 1;
+  }
+
+  std::deque<ChunkCopy> a, b, frames;
+  load_frames(file, a);
+  load_frames(other, b);
+  if (a.empty() || b.empty())
+  {
+    fprintf(stderr, "Error: no frames found\n");
+    return 1;
+  }
+
+  size_t i;
+  int switches = 0;
+  for (i = 0; i < a.size() || i < b.size(); i++)
+  {
+    if (i < a.size()) frames.push_back(a[i]);
+    if (i < b.size()) frames.push_back(b[i]);
+  }
+  for (i = 1; i < frames.size(); i++)
+    if (!(frames[i].spk == frames[i - 1].spk))
+      switches++;
+
+  fprintf(stderr, "Frames: %i, format switches: %i\n", int(frames.size()), switches);
+  fprintf(stderr, "Decoders      Time(ms)  Switch(us)\n");
+
+  NullSink sink;
+  Chunk chunk, dec_chunk, out_chunk;
+  double time[2];
+
+  for (int cached = 0; cached < 2; cached++)
+  {
+    FrameDecoder decoder(cached? 4: 1);
+    std::vector<double> run_time;
+
+    for (int run = 0; run <= runs; run++)
+    {
+      Speakers dec_spk, sink_spk;
+      double wall = wall_time();
+
+      for (i = 0; i <= frames.size(); i++)
+      {
+        // Flush the decoder at the format change and after the last frame
+        bool last = i == frames.size();
+        bool flushing = last || !(frames[i].spk == decoder.spk);
+        if (flushing && decoder.spk.format != FORMAT_UNKNOWN)
+          while (decoder.graph->flush(dec_chunk))
+            if (!switch_process(graph, decoder.graph->get_output(), dec_chunk, dec_spk, sink, sink_spk, packer))
+              return 1;
+
+        if (last)
+          break;
+
+        if (flushing && !decoder.start(frames[i].spk))
+        {
+          fprintf(stderr, "Error: unsupported file format %s\n", frames[i].spk.print().c_str());
+          return 1;
+        }
+
+        chunk = frames[i].chunk;
+        while (decoder.graph->process(chunk, dec_chunk))
+          if (!switch_process(graph, decoder.graph->get_output(), dec_chunk, dec_spk, sink, sink_spk, packer))
+            return 1;
+      }
+
+      while (graph.flush(out_chunk))
+        switch_output(graph, out_chunk, sink, sink_spk, packer);
+      sink.flush();
+
+      // First run is a warm-up
+      if (run > 0)
+        run_time.push_back(wall_time() - wall);
+    }
+
+    time[cached] = median(run_time);
+    fprintf(stderr, "%-10s %11.1f %11.1f\n", cached? "cached": "reopened",
+      time[cached] * 1000, switches? time[cached] * 1e6 / switches: 0);
+  }
+
+  if (switches)
+    fprintf(stderr, "Saved per switch: %.1fus\n", (time[0] - time[1]) * 1e6 / switches);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SIMD kernels microbenchmark
+///////////////////////////////////////////////////////////////////////////////
+
+// SIMD kernels against their C versions: speed and the maximum difference
+// of the results. The packer kernels must give identical output, returns
+// non-zero when they do not.
+static int bench_kernels(int runs)
+{
+  const size_t block = 4096;
+  int run;
+  size_t s;
+
+  fprintf(stderr, "CPU: %s\n", cpu_features().simd_name());
+#ifdef TOOLS_SSE2
+  if (!cpu_features().sse2)
+#endif
+  {
+    fprintf(stderr, "No SIMD kernels for this CPU\n");
+    return 0;
+  }
+
+#ifdef TOOLS_SSE2
+  std::vector<sample_t> in(block);
+  srand(0);
+  for (s = 0; s < block; s++)
+    in[s] = (sample_t(rand()) / RAND_MAX - 0.5) * 2.2; // some samples clip
+
+  // Exact halves of the LSB (pcm16) to check the rounding
+  for (s = 0; s < block; s += 4)
+    in[s] = (floor(in[s] * 32768.0) + 0.5) / 32768.0;
+
+  // PCM packer block conversion (pcm16)
+  std::vector<int32_t> out_c(block), out_simd(block);
+  double t_c = 0, t_simd = 0;
+  for (run = 0; run <= runs; run++)
+  {
+    double t0 = wall_time();
+    PCMPacker::convert_c(&in[0], 32768.0, -32768.0, 32767.0, &out_c[0], block);
+    double t1 = wall_time();
+    PCMPacker::convert_sse2(&in[0], 32768.0, -32768.0, 32767.0, &out_simd[0], block);
+    double t2 = wall_time();
+
+    // First run is a warm-up
+    if (run > 0)
+    {
+      t_c += t1 - t0;
+      t_simd += t2 - t1;
+    }
+  }
+
+  int max_diff = 0;
+  for (s = 0; s < block; s++)
+  {
+    int diff = abs(out_c[s] - out_simd[s]);
+    if (diff > max_diff) max_diff = diff;
+  }
+
+  double samples = double(block) * runs;
+  fprintf(stderr, "PCM pack (pcm16):\n");
+  fprintf(stderr, "  %-12s %8.3f ns/sample\n", "c", t_c * 1e9 / samples);
+  fprintf(stderr, "  %-12s %8.3f ns/sample\n", "sse2", t_simd * 1e9 / samples);
+  if (t_simd > 0)
+    fprintf(stderr, "  speedup      %8.2fx\n", t_c / t_simd);
+  fprintf(stderr, "  max diff     %8i LSB%s\n", max_diff, max_diff? " (MISMATCH)": "");
+
+  // Level meter
+  sample_t peak_c = 0, peak_simd = 0;
+  double sumsq_c = 0, sumsq_simd = 0;
+  t_c = t_simd = 0;
+  for (run = 0; run <= runs; run++)
+  {
+    double t0 = wall_time();
+    LevelMeter::measure_c(&in[0], block, peak_c, sumsq_c);
+    double t1 = wall_time();
+    LevelMeter::measure_sse2(&in[0], block, peak_simd, sumsq_simd);
+    double t2 = wall_time();
+
+    if (run > 0)
+    {
+      t_c += t1 - t0;
+      t_simd += t2 - t1;
+    }
+  }
+
+  fprintf(stderr, "Level meter:\n");
+  fprintf(stderr, "  %-12s %8.3f ns/sample\n", "c", t_c * 1e9 / samples);
+  fprintf(stderr, "  %-12s %8.3f ns/sample\n", "sse2", t_simd * 1e9 / samples);
+  if (t_simd > 0)
+    fprintf(stderr, "  speedup      %8.2fx\n", t_c / t_simd);
+  fprintf(stderr, "  max diff     peak %g, rms %.1e (relative)\n",
+    fabs(peak_c - peak_simd), sumsq_c > 0? fabs(sumsq_c - sumsq_simd) / sumsq_c: 0.0);
+  return max_diff? 1: 0;
+#endif
+}
+
 int valdec(const arg_list_t &args)
 {
   using std::string;
+  StartupReport startup;
   if (args.size() < 2)
   {
     fprintf(stderr, usage);
@@ -139,11 +1952,29 @@ int valdec(const arg_list_t &args)
   bool print_info = false;
   bool print_opt  = false;
   bool print_hist = false;
+  bool threads    = false;
+  int  dec_threads = 0;
+  bool profile     = false;
+  const char *profile_filename = 0;
+  bool use_index   = false;
+  bool use_readahead = false;
+  double start_time = -1;
+  double end_time   = -1;
+  bool normalize2   = false;
+  int  bench_kernels_runs = 0;
+  bool simd         = true;
+  bool startup_report = false;
+  const char *bench_switch_filename = 0;
+  bool fused        = false;
+  const char *meter_filename = 0;
+  bool meter_binary = false;
+  int  meter_window = 100;
 
   /////////////////////////////////////////////////////////
-  // Processing log
+  // Processing log. Written at a background thread, so
+  // trace logging does not slow down processing much.
 
-  LogFile logfile;
+  AsyncLogFile logfile;
 
   /////////////////////////////////////////////////////////
   // Input file
@@ -184,22 +2015,30 @@ int valdec(const arg_list_t &args)
   /////////////////////////////////////////////////////////
   // Sinks
 
-  enum { mode_undefined, mode_nothing, mode_play, mode_raw, mode_wav, mode_decode } mode = mode_undefined;
+  enum { mode_undefined, mode_nothing, mode_play, mode_raw, mode_wav, mode_shm, mode_hash, mode_decode, mode_bench } mode = mode_undefined;
+  int bench_runs = 0;
   const char *out_filename = 0;
 
   RAWSink    raw;
   WAVSink    wav;
   DSoundSink dsound;
   NullSink   null;
+  ShmSink    shm;
+  HashSink   hash;
 
   Sink *sink = 0;
   PlaybackControl *control = 0;
 
+  // Additional outputs. Output format options after an additional output
+  // apply to this output.
+  TeeOutputs tee;
+
   /////////////////////////////////////////////////////////
   // Filters
   /////////////////////////////////////////////////////////
 
   DVDGraph dvd_graph;
+  startup.mark("construction");
 
   /////////////////////////////////////////////////////////
   // Parse arguments
@@ -260,21 +2099,31 @@ int valdec(const arg_list_t &args)
     if (arg.is_option("spk", argt_enum))
     {
       int new_mask = arg.choose(mask_tbl, array_size(mask_tbl));
-      mask |= new_mask;
+      if (tee.size())
+        tee.back().mask |= new_mask;
+      else
+        mask |= new_mask;
       continue;
     }
 
     // -fmt - sample format
     if (arg.is_option("fmt", argt_enum))
     {
-      format = arg.choose(format_tbl, array_size(format_tbl));
+      int new_format = arg.choose(format_tbl, array_size(format_tbl));
+      if (tee.size())
+        tee.back().format = new_format;
+      else
+        format = new_format;
       continue;
     }
 
     // -rate - sample rate
     if (arg.is_option("rate", argt_int))
     {
-      sample_rate = arg.as_int();
+      if (tee.size())
+        tee.back().sample_rate = arg.as_int();
+      else
+        sample_rate = arg.as_int();
       continue;
     }
 
@@ -298,6 +2147,28 @@ int valdec(const arg_list_t &args)
       continue;
     }
 
+    // -bench:N - in-memory benchmark
+    if (arg.is_option("bench", argt_int))
+    {
+      if (sink)
+      {
+        fprintf(stderr, "-bench : ambiguous output mode\n");
+        return 1;
+      }
+
+      bench_runs = arg.as_int();
+      if (bench_runs < 1)
+      {
+        fprintf(stderr, "-bench : number of runs must be positive\n");
+        return 1;
+      }
+
+      sink = &null;
+      control = 0;
+      mode = mode_bench;
+      continue;
+    }
+
     // -p[lay] - play
     if (arg.is_option("p", argt_exist) || 
         arg.is_option("play", argt_exist))
@@ -317,78 +2188,276 @@ int valdec(const arg_list_t &args)
     // -r[aw] - RAW output
     if (arg.is_option("r", argt_exist) ||
         arg.is_option("raw", argt_exist))
+    {
+      if (args.size() - iarg < 1)
+      {
+        fprintf(stderr, "-raw : specify a file name\n");
+        return 1;
+      }
+
+      // Additional output
+      if (sink)
+      {
+        tee.add(args[++iarg].raw.c_str(), false);
+        continue;
+      }
+
+      out_filename = args[++iarg].raw.c_str();
+      sink = &raw;
+      control = 0;
+      mode = mode_raw;
+      continue;
+    }
+
+    // -w[av] - WAV output
+    if (arg.is_option("w", argt_exist) ||
+        arg.is_option("wav", argt_exist))
+    {
+      if (args.size() - iarg < 1)
+      {
+        fprintf(stderr, "-wav : specify a file name\n");
+        return 1;
+      }
+
+      // Additional output
+      if (sink)
+      {
+        tee.add(args[++iarg].raw.c_str(), true);
+        continue;
+      }
+
+      out_filename = args[++iarg].raw.c_str();
+      sink = &wav;
+      control = 0;
+      mode = mode_wav;
+      continue;
+    }
+
+    // -shm - shared memory output
+    if (arg.is_option("shm", argt_exist))
+    {
+      if (args.size() - iarg < 1)
+      {
+        fprintf(stderr, "-shm : specify a ring name\n");
+        return 1;
+      }
+
+      if (sink)
+      {
+        fprintf(stderr, "-shm : ambiguous output mode\n");
+        return 1;
+      }
+
+      out_filename = args[++iarg].raw.c_str();
+      sink = &shm;
+      control = 0;
+      mode = mode_shm;
+      continue;
+    }
+
+    // -hash - hash the output data
+    if (arg.is_option("hash", argt_exist))
+    {
+      if (sink)
+      {
+        fprintf(stderr, "-hash : ambiguous output mode\n");
+        return 1;
+      }
+
+      sink = &hash;
+      control = 0;
+      mode = mode_hash;
+      continue;
+    }
+
+    // -hash_samples - hash for each N output samples
+    if (arg.is_option("hash_samples", argt_int))
+    {
+      int n = arg.as_int();
+      if (n <= 0)
+      {
+        fprintf(stderr, "-hash_samples : number of samples must be positive\n");
+        return 1;
+      }
+      hash.set_segment_samples(n);
+      continue;
+    }
+
+    // -n[othing] - no output
+    if (arg.is_option("n", argt_exist) || 
+        arg.is_option("nothing", argt_exist))
     {
       if (sink)
       {
-        fprintf(stderr, "-raw : ambiguous output mode\n");
+        fprintf(stderr, "-nothing : ambiguous output mode\n");
+        return 1;
+      }
+
+      sink = &null;
+      control = 0;
+      mode = mode_nothing;
+      continue;
+    }
+    
+    ///////////////////////////////////////////////////////
+    // Processing
+    ///////////////////////////////////////////////////////
+
+    // -threads - pipelined multithreaded processing
+    if (arg.is_option("threads", argt_bool))
+    {
+      threads = arg.as_bool();
+      continue;
+    }
+
+    // -start - start time (sec)
+    if (arg.is_option("start", argt_double))
+    {
+      start_time = arg.as_double();
+      continue;
+    }
+
+    // -end - end time (sec)
+    if (arg.is_option("end", argt_double))
+    {
+      end_time = arg.as_double();
+      continue;
+    }
+
+    // -readahead - read the file ahead at a background thread
+    if (arg.is_option("readahead", argt_bool))
+    {
+      use_readahead = arg.as_bool();
+      continue;
+    }
+
+    // -index - use the frame index sidecar file
+    if (arg.is_option("index", argt_bool))
+    {
+      use_index = arg.as_bool();
+      continue;
+    }
+
+    // -fused - fused output stage
+    if (arg.is_option("fused", argt_bool))
+    {
+      fused = arg.as_bool();
+      continue;
+    }
+
+    // -dec_threads - frame-parallel decoding
+    if (arg.is_option("dec_threads", argt_int))
+    {
+      dec_threads = arg.as_int();
+      if (dec_threads <= 0)
+      {
+        fprintf(stderr, "-dec_threads : number of threads must be positive\n");
         return 1;
       }
+      continue;
+    }
+
+    ///////////////////////////////////////////////////////
+    // Info
+    ///////////////////////////////////////////////////////
+
+    // -i - print bitstream info
+    if (arg.is_option("i", argt_exist))
+    {
+      print_info = true;
+      continue;
+    }
+
+    // -profile - print time spent at each processing stage
+    if (arg.is_option("profile", argt_exist))
+    {
+      profile = true;
+      continue;
+    }
+
+    // -profile_json - write profile to a file in JSON format
+    if (arg.is_option("profile_json", argt_exist))
+    {
       if (args.size() - iarg < 1)
       {
-        fprintf(stderr, "-raw : specify a file name\n");
+        fprintf(stderr, "-profile_json : specify a file name\n");
         return 1;
       }
 
-      out_filename = args[++iarg].raw.c_str();
-      sink = &raw;
-      control = 0;
-      mode = mode_raw;
+      profile_filename = args[++iarg].raw.c_str();
+      profile = true;
       continue;
     }
 
-    // -w[av] - WAV output
-    if (arg.is_option("w", argt_exist) ||
-        arg.is_option("wav", argt_exist))
+    // -startup_report - print startup phases timing
+    if (arg.is_option("startup_report", argt_exist))
+    {
+      startup_report = true;
+      continue;
+    }
+
+    // -opt - print decoding options
+    if (arg.is_option("opt", argt_exist))
+    {
+      print_opt = true;
+      continue;
+    }
+
+    // -bench_switch - stream switch benchmark
+    if (arg.is_option("bench_switch", argt_exist))
     {
-      if (sink)
-      {
-        fprintf(stderr, "-wav : ambiguous output mode\n");
-        return 1;
-      }
       if (args.size() - iarg < 1)
       {
-        fprintf(stderr, "-wav : specify a file name\n");
+        fprintf(stderr, "-bench_switch : specify a file name\n");
         return 1;
       }
 
-      out_filename = args[++iarg].raw.c_str();
-      sink = &wav;
-      control = 0;
-      mode = mode_wav;
+      bench_switch_filename = args[++iarg].raw.c_str();
       continue;
     }
 
-    // -n[othing] - no output
-    if (arg.is_option("n", argt_exist) || 
-        arg.is_option("nothing", argt_exist))
+    // -bench_kernels - SIMD kernels microbenchmark
+    if (arg.is_option("bench_kernels", argt_int))
     {
-      if (sink)
+      bench_kernels_runs = arg.as_int();
+      if (bench_kernels_runs <= 0)
       {
-        fprintf(stderr, "-nothing : ambiguous output mode\n");
+        fprintf(stderr, "-bench_kernels : number of runs must be positive\n");
         return 1;
       }
+      continue;
+    }
 
-      sink = &null;
-      control = 0;
-      mode = mode_nothing;
+    // -simd - use SIMD kernels when the CPU supports them
+    if (arg.is_option("simd", argt_bool))
+    {
+      simd = arg.as_bool();
       continue;
     }
-    
-    ///////////////////////////////////////////////////////
-    // Info
-    ///////////////////////////////////////////////////////
 
-    // -i - print bitstream info
-    if (arg.is_option("i", argt_exist))
+    // -meter, -meter_bin - write levels time series to a file
+    if (arg.is_option("meter", argt_exist) || arg.is_option("meter_bin", argt_exist))
     {
-      print_info = true;
+      meter_binary = arg.is_option("meter_bin", argt_exist);
+      if (args.size() - iarg < 1)
+      {
+        fprintf(stderr, "%s : specify a file name\n", meter_binary? "-meter_bin": "-meter");
+        return 1;
+      }
+
+      meter_filename = args[++iarg].raw.c_str();
       continue;
     }
 
-    // -opt - print decoding options
-    if (arg.is_option("opt", argt_exist))
+    // -meter_window - metering window (ms)
+    if (arg.is_option("meter_window", argt_int))
     {
-      print_opt = true;
+      meter_window = arg.as_int();
+      if (meter_window <= 0)
+      {
+        fprintf(stderr, "-meter_window : window must be positive\n");
+        return 1;
+      }
       continue;
     }
 
@@ -409,7 +2478,11 @@ int valdec(const arg_list_t &args)
       }
 
       const char *log_filename = args[++iarg].raw.c_str();
-      logfile.open(log_filename);
+      if (!logfile.open(log_filename))
+      {
+        fprintf(stderr, "-log : cannot open file '%s'\n", log_filename);
+        return 1;
+      }
       logfile.subscribe(&valib_log_dispatcher);
       continue;
     }
@@ -527,6 +2600,13 @@ int valdec(const arg_list_t &args)
       continue;
     }
 
+    // -normalize2 - two-pass normalization
+    if (arg.is_option("normalize2", argt_exist))
+    {
+      normalize2 = true;
+      continue;
+    }
+
     // -drc
     if (arg.is_option("drc", argt_bool))
     {
@@ -595,20 +2675,60 @@ int valdec(const arg_list_t &args)
   // Open input file and load the first frame
   /////////////////////////////////////////////////////////
 
+  startup.mark("arguments");
+
   if (!parser)
     parser = &uni;
 
+  if (start_time > 0 && end_time > 0 && end_time <= start_time)
+  {
+    fprintf(stderr, "Error: end time must be greater than start time\n");
+    return 1;
+  }
+
   if (!file.open(input_filename, parser, 1000000))
   {
     fprintf(stderr, "Error: Cannot open file '%s'\n", input_filename);
     return 1;
   }
 
-  if (!file.stats() || !file.probe())
+  ReadAhead readahead;
+  if (use_readahead && !readahead.open(input_filename))
+    fprintf(stderr, "Warning: cannot start read-ahead for '%s'\n", input_filename);
+  startup.mark("file open");
+
+  /////////////////////////////////////////////////////////
+  // Load or build the frame index. With the index we do
+  // not need to scan the file for statistics. Seeking to
+  // the start point requires the index too, but we do not
+  // save it when not asked to.
+
+  FrameIndex index;
+  bool index_loaded = false;
+  if (use_index || start_time > 0 || (normalize2 && end_time > 0))
+  {
+    string index_filename = FrameIndex::sidecar_name(input_filename);
+    if (use_index && index.load(index_filename.c_str(), input_filename))
+      index_loaded = true;
+    else if (index.build(file, input_filename))
+    {
+      if (use_index && !index.save(index_filename.c_str()))
+        fprintf(stderr, "Warning: cannot write frame index '%s'\n", index_filename.c_str());
+      file.seek(0);
+    }
+    else
+      fprintf(stderr, "Warning: cannot build frame index\n");
+    startup.mark("frame index");
+  }
+
+  // File statistics require a scan of the file, so do it only
+  // when the info is printed.
+  if ((print_info && !file.stats()) || !file.probe())
   {
     fprintf(stderr, "Error: Cannot detect input file format\n", input_filename);
     return 1;
   }
+  startup.mark("probe");
 
   /////////////////////////////////////////////////////////
   // Print file info
@@ -617,6 +2737,9 @@ int valdec(const arg_list_t &args)
   if (print_info)
   {
     fprintf(stderr, "%s\n", file.file_info().c_str());
+    if (!index.is_empty())
+      fprintf(stderr, "Frame index: %i points, %i stream(s), %.3fs (%s)\n",
+        int(index.size()), index.streams(), index.duration(), index_loaded? "loaded": "built");
     fprintf(stderr, "%s", file.stream_info().c_str());
   }
 
@@ -642,6 +2765,33 @@ int valdec(const arg_list_t &args)
     return 1;
   }
 
+  // Two-pass normalization: scan the peak level after processing, then
+  // process with a constant gain. Master gain sets the target peak level.
+  if (normalize2)
+  {
+    sample_t target = dvd_graph.proc.get_master();
+    sample_t peak = 0;
+
+    dvd_graph.proc.set_auto_gain(false);
+    dvd_graph.proc.set_normalize(false);
+    bool trimmed = (start_time > 0 || end_time > 0) && !index.is_empty();
+    if (!scan_peak(input_filename, file.get_size(), file.frame_info().frame_size,
+                   trimmed? &index: 0, start_time, end_time,
+                   dec_threads, dvd_graph.proc, user_spk, peak))
+    {
+      fprintf(stderr, "Error: peak level scan failed\n");
+      return 1;
+    }
+
+    if (peak > 0)
+    {
+      sample_t gain = target * user_spk.level / peak;
+      dvd_graph.proc.set_master(gain);
+      fprintf(stderr, "True peak level: %.2fdB, gain: %.2fdB\n",
+        value2db(peak / user_spk.level), value2db(gain));
+    }
+  }
+
   Speakers in_spk = file.get_output();
   if (!dvd_graph.open(in_spk))
   {
@@ -649,6 +2799,112 @@ int valdec(const arg_list_t &args)
     return 1;
   }
 
+  // Additional outputs share the decoder, each output has its own
+  // processing graph.
+  FrameDecoder tee_decoder;
+  if (tee.size())
+  {
+    if (mode == mode_bench)
+      fprintf(stderr, "Warning: additional outputs are ignored in benchmark mode\n");
+    if (threads)
+    {
+      fprintf(stderr, "Warning: -threads is ignored with several outputs\n");
+      threads = false;
+    }
+    if (profile)
+    {
+      fprintf(stderr, "Warning: -profile is ignored with several outputs\n");
+      profile = false;
+      profile_filename = 0;
+    }
+
+    for (size_t itee = 0; itee < tee.size(); itee++)
+    {
+      TeeOutput &out = tee[itee];
+      copy_proc_options(out.graph.proc, dvd_graph.proc);
+
+      Speakers tee_spk(out.format, out.mask, out.sample_rate);
+      if (!out.graph.set_user(tee_spk))
+      {
+        fprintf(stderr, "Error: unsupported user format %s (%s)\n", tee_spk.print().c_str(), out.filename);
+        return 1;
+      }
+    }
+
+    if (!dec_threads && !tee_decoder.start(in_spk))
+    {
+      fprintf(stderr, "Error: unsupported file format %s\n", in_spk.print().c_str());
+      return 1;
+    }
+  }
+
+  // Fused output stage: the processor outputs linear data in the standard
+  // order without output gains, the packer applies gains, reorders, clips
+  // and packs the data in one pass.
+  PCMPacker packer;
+  if (meter_filename)
+    fused = true; // metering works at the fused output stage
+
+  if (fused)
+  {
+    if (profile)
+    {
+      fprintf(stderr, "Warning: -fused is ignored with -profile\n");
+      fused = false;
+    }
+    else if (!PCMPacker::is_supported(format))
+    {
+      fprintf(stderr, "Warning: -fused does not support this output format\n");
+      fused = false;
+    }
+    else
+    {
+      sample_t unity_gains[CH_NAMES];
+      for (i = 0; i < CH_NAMES; i++)
+        unity_gains[i] = 1.0;
+
+      packer.init(format, gains, std_order, win_order);
+      packer.set_simd(simd);
+      dvd_graph.proc.set_output_gains(unity_gains);
+      dvd_graph.proc.set_output_order(std_order);
+      dvd_graph.set_user(Speakers(FORMAT_LINEAR, mask, sample_rate, user_spk.level));
+    }
+  }
+
+  if (meter_filename && !fused)
+  {
+    fprintf(stderr, "Error: metering requires the fused output stage\n");
+    return 1;
+  }
+
+  // Profiling splits the graph into the decoder, the processor and the
+  // output converter to time them separately.
+  Profiler profiler;
+  FrameDecoder profile_decoder;
+  Converter profile_conv(2048);
+  ProfiledChain profile_chain(&profiler);
+  if (profile)
+  {
+    if (threads || dec_threads)
+    {
+      fprintf(stderr, "Warning: -profile works in single-threaded mode only\n");
+      threads = false;
+      dec_threads = 0;
+    }
+
+    profile_conv.set_format(format);
+    dvd_graph.set_user(Speakers(FORMAT_LINEAR, mask, sample_rate, user_spk.level));
+    if (!profile_decoder.start(in_spk))
+    {
+      fprintf(stderr, "Error: unsupported file format %s\n", in_spk.print().c_str());
+      return 1;
+    }
+
+    profile_chain.add_back(profile_decoder.graph, Profiler::decoder);
+    profile_chain.add_back(&dvd_graph, Profiler::processor);
+    profile_chain.add_back(&profile_conv, Profiler::converter);
+  }
+
   Speakers out_spk = user_spk;
   if (!out_spk.mask)
     out_spk.mask = in_spk.mask;
@@ -659,9 +2915,38 @@ int valdec(const arg_list_t &args)
   // Print processing options
   /////////////////////////////////////////////////////////
 
-  //
-  // TODO
-  //
+  if (print_opt)
+  {
+    AudioProcessor &proc = dvd_graph.proc;
+    fprintf(stderr, "Processing options:\n");
+    fprintf(stderr, "  Output:  %s\n", out_spk.print().c_str());
+    fprintf(stderr, "  Matrix:  %s\n", proc.get_auto_matrix()? "auto": "custom");
+    fprintf(stderr, "  Levels:  clev %.1fdB, slev %.1fdB, lfelev %.1fdB, master %.1fdB\n",
+      value2db(proc.get_clev()), value2db(proc.get_slev()),
+      value2db(proc.get_lfelev()), value2db(proc.get_master()));
+    fprintf(stderr, "  AGC:     %s, normalize %s, drc %s (%.1fdB)\n",
+      proc.get_auto_gain()? "on": "off", proc.get_normalize()? "on": "off",
+      proc.get_drc()? "on": "off", proc.get_drc_power());
+    fprintf(stderr, "  Delay:   %s\n", proc.get_delay()? "on": "off");
+    fprintf(stderr, "  Threads: %s\n",
+      dec_threads? "frame-parallel decoding": threads? "pipelined": "single");
+  }
+
+  if (bench_kernels_runs)
+  {
+    return bench_kernels(bench_kernels_runs);
+  }
+
+  /////////////////////////////////////////////////////////
+  // Benchmark
+  /////////////////////////////////////////////////////////
+
+  if (mode == mode_bench && bench_switch_filename)
+    return bench_switch(file, bench_switch_filename, dvd_graph, fused? &packer: 0, bench_runs);
+  if (mode == mode_bench)
+    return bench(file, dvd_graph, fused? &packer: 0, bench_runs);
+
+  startup.mark("processing setup");
 
   /////////////////////////////////////////////////////////
   // Open output file
@@ -692,6 +2977,14 @@ int valdec(const arg_list_t &args)
       }
       break;
 
+    case mode_shm:
+      if (!out_filename || !shm.open_ring(out_filename))
+      {
+        fprintf(stderr, "Error: failed to create shared memory ring '%s' (name in use?)\n", out_filename);
+        return 1;
+      }
+      break;
+
     case mode_play:
       if (!dsound.open_dsound(0))
       {
@@ -703,21 +2996,46 @@ int valdec(const arg_list_t &args)
     // do nothing for other modes
   }
 
+  // The packer applies output gains after metering, the meter applies
+  // them to the levels.
+  LevelMeter meter;
+  meter.set_simd(simd);
+  meter.set_gains(gains);
+  if (meter_filename && !meter.open(meter_filename, meter_binary, meter_window / 1000.0, start_time > 0? start_time: 0))
+  {
+    fprintf(stderr, "Error: failed to open levels file '%s'\n", meter_filename);
+    return 1;
+  }
+
+  for (size_t itee = 0; itee < tee.size(); itee++)
+    if (!tee[itee].open_file())
+    {
+      fprintf(stderr, "Error: failed to open output file '%s'\n", tee[itee].filename);
+      return 1;
+    }
+  startup.mark("output open");
+
   /////////////////////////////////////////////////////////
   // Process
   /////////////////////////////////////////////////////////
 
-  Chunk chunk, out_chunk;
+  Chunk chunk, dec_chunk, out_chunk, pcm_chunk;
+  Speakers sink_spk; // format the sink is open with
+  Speakers dec_spk; // format of decoded data (decoding apart from processing)
 
   CPUMeter cpu_current;
   CPUMeter cpu_total;
 
   cpu_current.start();
   cpu_total.start();
+  double start_process_time = process_time();
 
   double time = 0;
   double old_time = 0;
 
+  double pos = 0;
+  int frames = 0;
+
   sample_t levels[CH_NAMES];
   sample_t level = 0;
 
@@ -725,11 +3043,45 @@ int valdec(const arg_list_t &args)
 
 //  fprintf(stderr, " 0.0%% Frs:      0 Err: 0 Time:   0:00.000i Level:    0dB FPS:    0 CPU: 0%%\r"); 
 
-  file.seek(0);
+  /////////////////////////////////////////////////////////
+  // Seek to the start point
+
+  const double preroll_time = 0.25;
+  double skip_time = start_time > 0? start_time: 0;
+  double length = end_time > 0? end_time - skip_time: 0;
+  OutputTrim trim;
+
+  if (start_time > 0 && !index.is_empty())
+  {
+    uint64_t offset;
+    double offset_time;
+    index.find(start_time > preroll_time? start_time - preroll_time: 0, offset, offset_time);
+    file.seek(fsize_t(offset));
+
+    // The parser syncs at the first frame after the position. Take the
+    // real start of this frame and its time and decode from this frame,
+    // so the output is trimmed from the time of the first decoded sample.
+    Chunk first;
+    if (file.get_chunk(first))
+    {
+      fsize_t frame_pos = file.get_pos() - first.size;
+      offset_time = index.time_at(uint64_t(frame_pos));
+      file.seek(frame_pos);
+    }
+    skip_time = start_time - offset_time;
+  }
+  else
+    file.seek(0);
+
+  trim.init(skip_time, length);
+  tee.init_trim(skip_time, length);
+
+  // Duration of the output (after trimming), the base of the CPU usage
+  double out_time = 0;
 
   #define PRINT_STAT                                                                                           \
   {                                                                                                            \
-    if (control)                                                                                               \
+    if (control && !threads)                                                                                   \
     {                                                                                                          \
       dvd_graph.proc.get_output_levels(control->get_playback_time(), levels);                                  \
       level = levels[0];                                                                                       \
@@ -738,11 +3090,11 @@ int valdec(const arg_list_t &args)
           level = levels[i];                                                                                   \
     }                                                                                                          \
     fprintf(stderr, "%4.1f%% Frames: %-6i Time: %3i:%02i.%03i Level: %-4idB FPS: %-4i CPU: %.1f%%  \r",        \
-      file.get_pos(file.relative) * 100,                                                                       \
-      file.get_frames(),                                                                                       \
+      pos * 100,                                                                                               \
+      frames,                                                                                                  \
       int(time/60), int(time) % 60, int(time * 1000) % 1000,                                                   \
       int(value2db(level)),                                                                                    \
-      int(file.get_frames() / time),                                                                           \
+      int(frames / time),                                                                                      \
       cpu_current.usage() * 100);                                                                              \
     fflush(stderr);                                                                                            \
   }
@@ -753,75 +3105,332 @@ int valdec(const arg_list_t &args)
     fflush(stderr);                                                                                              \
   }
 
-  while (file.get_chunk(chunk))
+  #define PROCESS_OUTPUT(graph)                                                                                  \
+  {                                                                                                              \
+    if ((graph).new_stream())                                                                                    \
+    {                                                                                                            \
+      Speakers new_spk = (graph).get_output();                                                                   \
+      if (fused) new_spk = packer.get_output(new_spk);                                                           \
+      if (new_spk == sink_spk)                                                                                   \
+        ; /* same format, keep the sink open */                                                                  \
+      else if (sink->open(new_spk))                                                                              \
+      {                                                                                                          \
+        sink_spk = new_spk;                                                                                      \
+        DROP_STAT;                                                                                               \
+        fprintf(stderr, "Opening audio output %s...\n", new_spk.print().c_str());                                \
+      }                                                                                                          \
+      else                                                                                                       \
+      {                                                                                                          \
+        fprintf(stderr, "\nOutput format %s is unsupported\n", new_spk.print().c_str());                         \
+        return 1;                                                                                                \
+      }                                                                                                          \
+    }                                                                                                            \
+    trim.cut((graph).get_output(), out_chunk);                                                                   \
+    out_time += chunk_time((graph).get_output(), out_chunk);                                                     \
+    if (fused)                                                                                                   \
+    {                                                                                                            \
+      meter.process((graph).get_output(), out_chunk);                                                            \
+      packer.pack((graph).get_output(), out_chunk, pcm_chunk);                                                   \
+    }                                                                                                            \
+    if (profile) profiler.begin(Profiler::sink);                                                                \
+    sink->process(fused? pcm_chunk: out_chunk);                                                                  \
+    startup.first_output();                                                                                      \
+    if (profile) profiler.end(Profiler::sink);                                                                  \
+  }
+
+  // Process decoded data when decoding is done apart from processing:
+  // pass it to additional outputs and to the main graph.
+  #define PROCESS_DECODED(new_spk, decoded)                                                                      \
+  {                                                                                                              \
+    if (!((new_spk) == dec_spk))                                                                                 \
+    {                                                                                                            \
+      while (dvd_graph.flush(out_chunk))                                                                         \
+        PROCESS_OUTPUT(dvd_graph);                                                                               \
+                                                                                                                 \
+      if (!dvd_graph.open(new_spk))                                                                              \
+      {                                                                                                          \
+        fprintf(stderr, "\nError: unsupported decoded format %s\n", (new_spk).print().c_str());                  \
+        return 1;                                                                                                \
+      }                                                                                                          \
+      dec_spk = (new_spk);                                                                                       \
+    }                                                                                                            \
+                                                                                                                 \
+    if (!tee.process(dec_spk, decoded))                                                                          \
+      return 1;                                                                                                  \
+                                                                                                                 \
+    chunk = (decoded);                                                                                           \
+    while (dvd_graph.process(chunk, out_chunk))                                                                  \
+      PROCESS_OUTPUT(dvd_graph);                                                                                 \
+  }
+
+  if (dec_threads > 0)
   {
-    /////////////////////////////////////////////////////
-    // Switch to a new stream
+    ///////////////////////////////////////////////////
+    // Frame-parallel decoding: frames are decoded at
+    // the thread pool, processing and output are done
+    // here in order.
+
+    ParallelDecoder decoder(&file, print_info);
+    if (!decoder.start(dec_threads))
+    {
+      fprintf(stderr, "Error: cannot start decoding threads\n");
+      return 1;
+    }
 
-    if (file.new_stream())
+    string stream_info;
+    ChunkCopy *slot;
+
+    while ((slot = decoder.get_chunk()) != 0)
     {
-      if (streams > 0)
+      pos = decoder.pos;
+      frames = decoder.frames;
+
+      /////////////////////////////////////////////////
+      // Switch to a new stream
+
+      while (decoder.get_info(stream_info))
+      {
         PRINT_STAT;
+        fprintf(stderr, "\n\n%s", stream_info.c_str());
+      }
 
-      if (streams > 0 && print_info)
-        fprintf(stderr, "\n\n%s", file.stream_info().c_str());
+      PROCESS_DECODED(slot->spk, slot->chunk);
 
-      streams++;
-      if (mode == mode_nothing)
-        return 0;
+      if (trim.is_done() || shm.reader_gone())
+        break;
+
+      /////////////////////////////////////////////////
+      // Statistics
+
+      readahead.update(fsize_t(pos * readahead.get_size()));
+      time = cpu_total.get_system_time();
+      if (time > old_time + 0.1)
+      {
+        old_time = time;
+        PRINT_STAT;
+      }
+    }
+
+    if (decoder.failed())
+    {
+      fprintf(stderr, "\nProcessing error: %s\n", decoder.error().c_str());
+      return -1;
     }
 
-    while (dvd_graph.process(chunk, out_chunk))
+    while (dvd_graph.flush(out_chunk))
+      PROCESS_OUTPUT(dvd_graph);
+
+    streams = decoder.streams;
+  }
+  else if (threads)
+  {
+    ///////////////////////////////////////////////////
+    // Pipelined processing: the parser and the graph
+    // work at their own threads, the sink works here.
+
+    ChunkQueue frame_queue(64);
+    ChunkQueue out_queue(16);
+    ParserThread parser_thread(&file, &frame_queue, print_info);
+    GraphThread  graph_thread(&dvd_graph, &frame_queue, &out_queue);
+
+    parser_thread.start();
+    graph_thread.start();
+
+    int result = 0;
+    string stream_info;
+    ChunkCopy *slot;
+
+    try
     {
-      if (dvd_graph.new_stream())
+      while ((slot = out_queue.begin_read()) != 0)
       {
-        Speakers new_spk = dvd_graph.get_output();
-        if (sink->open(new_spk))
+        pos = slot->pos;
+        frames = slot->frames;
+
+        ///////////////////////////////////////////////
+        // Switch to a new stream
+
+        while (parser_thread.get_info(stream_info))
+        {
+          PRINT_STAT;
+          fprintf(stderr, "\n\n%s", stream_info.c_str());
+        }
+
+        if (slot->new_stream)
+        {
+          Speakers new_spk = fused? packer.get_output(slot->spk): slot->spk;
+          if (new_spk == sink_spk)
+            ; // same format, keep the sink open
+          else if (sink->open(new_spk))
+          {
+            sink_spk = new_spk;
+            DROP_STAT;
+            fprintf(stderr, "Opening audio output %s...\n", new_spk.print().c_str());
+          }
+          else
+          {
+            fprintf(stderr, "\nOutput format %s is unsupported\n", new_spk.print().c_str());
+            result = 1;
+            break;
+          }
+        }
+        trim.cut(slot->spk, slot->chunk);
+        out_time += chunk_time(slot->spk, slot->chunk);
+        if (fused)
         {
-          DROP_STAT;
-          fprintf(stderr, "Opening audio output %s...\n", new_spk.print().c_str());
+          meter.process(slot->spk, slot->chunk);
+          packer.pack(slot->spk, slot->chunk, pcm_chunk);
+          sink->process(pcm_chunk);
         }
         else
+          sink->process(slot->chunk);
+        startup.first_output();
+        out_queue.end_read();
+
+        if (trim.is_done() || shm.reader_gone())
+          break;
+
+        ///////////////////////////////////////////////
+        // Statistics
+
+        readahead.update(fsize_t(pos * readahead.get_size()));
+        time = cpu_total.get_system_time();
+        if (time > old_time + 0.1)
         {
-          fprintf(stderr, "\nOutput format %s is unsupported\n", new_spk.print().c_str());
-          return 1;
+          old_time = time;
+          PRINT_STAT;
         }
       }
-      sink->process(out_chunk);
     }
+    catch (...)
+    {
+      frame_queue.abort();
+      out_queue.abort();
+      parser_thread.wait();
+      graph_thread.wait();
+      throw;
+    }
+
+    // The loop may stop before the end of the stream (error, trim end,
+    // shm reader gone) with both threads blocked at the queues. Abort is
+    // harmless after the end of the stream.
+    frame_queue.abort();
+    out_queue.abort();
+    parser_thread.wait();
+    graph_thread.wait();
+    streams = parser_thread.streams;
 
-    /////////////////////////////////////////////////////
-    // Statistics
+    if (result)
+      return result;
 
-    time = cpu_total.get_system_time();
-    if (time > old_time + 0.1)
+    if (parser_thread.failed() || graph_thread.failed())
     {
-      old_time = time;
-      PRINT_STAT;
+      fprintf(stderr, "\nProcessing error: %s\n", parser_thread.failed()?
+        parser_thread.error().c_str(): graph_thread.error().c_str());
+      return -1;
     }
-
   }
-
-  while (dvd_graph.flush(out_chunk))
+  else
   {
-    if (dvd_graph.new_stream())
+    if (profile)
+      profiler.start_run();
+
+    while (get_frame(file, chunk, profile? &profiler: 0))
     {
-      Speakers new_spk = dvd_graph.get_output();
-      if (sink->open(new_spk))
+      pos = file.get_pos(file.relative);
+      frames = file.get_frames();
+
+      /////////////////////////////////////////////////////
+      // Switch to a new stream
+
+      if (file.new_stream())
+      {
+        if (streams > 0)
+          PRINT_STAT;
+
+        if (streams > 0 && print_info)
+          fprintf(stderr, "\n\n%s", file.stream_info().c_str());
+
+        streams++;
+        if (mode == mode_nothing)
+          return 0;
+      }
+
+      if (profile)
       {
-        DROP_STAT;
-        fprintf(stderr, "Opening audio output %s...\n", new_spk.print().c_str());
+        while (profile_chain.process(chunk, out_chunk))
+          PROCESS_OUTPUT(profile_chain);
+      }
+      else if (tee.size())
+      {
+        Chunk file_chunk = chunk;
+        while (tee_decoder.graph->process(file_chunk, dec_chunk))
+          PROCESS_DECODED(tee_decoder.graph->get_output(), dec_chunk);
       }
       else
       {
-        fprintf(stderr, "\nOutput format %s is unsupported\n", new_spk.print().c_str());
-        return 1;
+        while (dvd_graph.process(chunk, out_chunk))
+          PROCESS_OUTPUT(dvd_graph);
+      }
+
+      if (trim.is_done() || shm.reader_gone())
+        break;
+
+      /////////////////////////////////////////////////////
+      // Statistics
+
+      readahead.update(fsize_t(pos * readahead.get_size()));
+      time = cpu_total.get_system_time();
+      if (time > old_time + 0.1)
+      {
+        old_time = time;
+        PRINT_STAT;
+      }
+
+    }
+
+    if (profile)
+    {
+      while (profile_chain.flush(out_chunk))
+        PROCESS_OUTPUT(profile_chain);
+
+      if (profile_chain.failed())
+      {
+        fprintf(stderr, "\nProcessing error: %s\n", profile_chain.error().c_str());
+        return -1;
       }
     }
-    sink->process(out_chunk);
+    else if (tee.size())
+    {
+      while (tee_decoder.graph->flush(dec_chunk))
+        PROCESS_DECODED(tee_decoder.graph->get_output(), dec_chunk);
+
+      while (dvd_graph.flush(out_chunk))
+        PROCESS_OUTPUT(dvd_graph);
+    }
+    else
+    {
+      while (dvd_graph.flush(out_chunk))
+        PROCESS_OUTPUT(dvd_graph);
+    }
   }
 
+  if (!tee.flush())
+    return 1;
+
+  if (profile) profiler.begin(Profiler::sink);
   sink->flush();
+  if (profile)
+  {
+    profiler.end(Profiler::sink);
+    profiler.stop_run();
+  }
+
+  if (!meter.close())
+  {
+    fprintf(stderr, "\nError: failed to write levels file '%s'\n", meter_filename);
+    return 1;
+  }
 
   /////////////////////////////////////////////////////
   // Stop
@@ -829,6 +3438,11 @@ int valdec(const arg_list_t &args)
   cpu_current.stop();
   cpu_total.stop();
 
+  // All threads are counted in multithreaded mode
+  double cpu_time = (threads || dec_threads)?
+    process_time() - start_process_time:
+    cpu_total.get_thread_time();
+
   /////////////////////////////////////////////////////
   // Final statistics
 
@@ -837,9 +3451,46 @@ int valdec(const arg_list_t &args)
   if (streams > 1)
     fprintf(stderr, "Streams found: %i\n", streams);
   fprintf(stderr, "Frames: %i\n", file.get_frames());
+  if (shm.reader_gone())
+    fprintf(stderr, "Output stopped: shared memory reader is gone\n");
   fprintf(stderr, "System time: %ims\n", int(cpu_total.get_system_time() * 1000));
-  fprintf(stderr, "Process time: %ims\n", int(cpu_total.get_thread_time() * 1000 ));
-  fprintf(stderr, "Approx. %.2f%% realtime CPU usage\n", double(cpu_total.get_thread_time() * 100) / file.get_size(file.time));
+  fprintf(stderr, "Process time: %ims\n", int(cpu_time * 1000 ));
+  // Duration of the output actually produced (trimmed range, or less when
+  // the output stops early). Without output: from the index, from file
+  // statistics (-i) or from the number of frames processed.
+  double duration = 0;
+  if (out_time > 0)
+    duration = out_time;
+  else if (!index.is_empty())
+    duration = index.duration();
+  else if (print_info)
+    duration = file.get_size(file.time);
+  else
+  {
+    FrameInfo finfo = file.frame_info();
+    if (finfo.spk.sample_rate)
+      duration = double(file.get_frames()) * finfo.nsamples / finfo.spk.sample_rate;
+  }
+  if (duration > 0)
+    fprintf(stderr, "Approx. %.2f%% realtime CPU usage\n", double(cpu_time * 100) / duration);
+  if (logfile.get_overflows())
+    fprintf(stderr, "Log entries dropped: %i\n", logfile.get_overflows());
+  if (startup_report)
+    startup.print(stderr);
+
+  /////////////////////////////////////////////////////////
+  // Print profile
+  /////////////////////////////////////////////////////////
+
+  if (profile)
+  {
+    profiler.print(stderr, file.get_frames());
+    if (profile_filename && !profiler.write_json(profile_filename, input_filename, file.get_frames()))
+    {
+      fprintf(stderr, "Error: cannot write profile to '%s'\n", profile_filename);
+      return 1;
+    }
+  }
 
   /////////////////////////////////////////////////////////
   // Print levels histogram
@@ -15,11 +15,45 @@ const char *usage =
 "\n"
 "  output mode:\n"
 "    -d[ecode]  - just decode (used for testing and performance measurements)\n"
+"    -bench:N   - benchmark: load the file into memory and decode it N times\n"
+"      (after a warm-up run). Prints min/median/max frames per second,\n"
+"      x realtime factor and CPU time per run, and the time to decode and\n"
+"      process a single frame (median, 99 and 99.9 percentiles, maximum).\n"
+"      With -bench_switch other_file frames of both files are interleaved,\n"
+"      so the format switches at each frame (as in SPDIF captures switching\n"
+"      between AC3 and DTS), and the time per switch is printed with decoders\n"
+"      reused from the cache and with decoders reopened at each switch.\n"
 "    -p[lay]    - play file (*)\n"
 "    -r[aw] file.raw - decode to RAW file\n"
 "    -w[av] file.wav - decode to WAV file\n"
+"    -shm name  - decode to the shared memory ring for another process\n"
+"      Decoded data goes to the memory ring with the name given, another\n"
+"      process reads it from there (ac3enc accepts shm:name as the input\n"
+"      file). Format changes are passed with the data. Decoding\n"
+"      waits when the ring is full and stops when the reader is closed or\n"
+"      its process exits. Fails when a ring with this name is in use.\n"
+"      Example:\n"
+"        valdec a.ac3 -shm ring1\n"
+"        ac3enc shm:ring1 a_new.ac3\n"
+"    -hash      - print hashes of the output data instead of writing it\n"
+"      A 64bit xxHash (XXH64) of the output data is printed to stdout for\n"
+"      each stream (continuous part of the output with the same format). It\n"
+"      equals to XXH64 of the RAW file written with the same options, so\n"
+"      regression checks may compare hashes instead of files.\n"
+"    -hash_samples:N - with -hash print a hash for each N output samples\n"
+"      too, so a mismatch points to the range where the output differs.\n"
+"      Ranges are counted in output samples, so they do not depend on the\n"
+"      input frame size or on -dec_threads.\n"
 "    -n[othing] - do nothing (to be used with -i option)\n"
 "\n"
+"    Several -w and -r outputs may be given to write several files in one\n"
+"    pass. The file is decoded once and each output has its own mixer,\n"
+"    resampler and converter. Output options (-spk, -fmt, -rate) given after\n"
+"    the second and following outputs apply to that output only (defaults are\n"
+"    input layout, input sample rate and pcm16). Processing options are the\n"
+"    same for all outputs. Example:\n"
+"      valdec a.ac3 -w a.wav -spk:stereo -w b.wav -fmt:pcm_float\n"
+"\n"
 "  output options:\n"
 "    -spk:{layout} - define output channel layout\n"
 "      You may choose a predefined layout and/or specify each channel\n"
@@ -74,10 +108,74 @@ const char *usage =
 "    -dts - force dts (do not autodetect format)\n"
 "    -mpa - force mpa (do not autodetect format)\n"
 "\n"
+"  processing:\n"
+"    -threads[+|-] - pipelined multithreaded processing on/off(*)\n"
+"      File parsing, decoding/processing and output work at separate threads\n"
+"      simultaneously. Output is the same as in single-threaded mode.\n"
+"    -dec_threads:N - decode frames in parallel at N threads\n"
+"      Groups of frames are decoded independently at N threads, processing\n"
+"      (mixer, agc, delay, etc) is done after the decoder in order. Each group\n"
+"      is started with a few frames of the previous group to warm up the\n"
+"      decoder (16 frames for MPA to cover the layer III bit reservoir, 4 for\n"
+"      AC3 and DTS, 16 for other formats). Equality with the single-threaded\n"
+"      output is not guaranteed: compare -hash output with and without\n"
+"      -dec_threads to check a file. Useful for batch conversion with -decode,\n"
+"      -wav or -raw output modes.\n"
+"    -fused[+|-] - fused output stage on/off(*)\n"
+"      Output channel gains, channel reordering, clipping and conversion to\n"
+"      the output sample format are done in one pass over the data. Works\n"
+"      with pcm16, pcm24, pcm32, pcm_float and pcm_double output formats.\n"
+"    -readahead[+|-] - read the file ahead at a background thread on/off(*)\n"
+"      A background thread reads up to 16Mb ahead of the decoding position,\n"
+"      so the parser does not wait for the disk. Helps with slow or network\n"
+"      storage and with files not in the system cache.\n"
+"    -index[+|-] - use the frame index file on/off(*)\n"
+"      Frame index (some_file.vidx) is a map of the file: stream formats and\n"
+"      timestamps for file positions. When the index file is missing or\n"
+"      outdated, it is built with a fast sampled scan and saved (VBR streams\n"
+"      need a scan of all frame headers to get exact times). With the index\n"
+"      valdec starts without the full file scan.\n"
+"    -start:sec - start decoding at the time given (in seconds)\n"
+"      valdec seeks to the nearest frame using the frame index (the index is\n"
+"      built in memory when -index is off) and decodes a short preroll before\n"
+"      the start point, so no full file scan is done. The output is trimmed\n"
+"      from the time of the first decoded frame, so it starts at the sample\n"
+"      of the start time.\n"
+"    -end:sec - stop decoding at the time given (in seconds)\n"
+"\n"
 "  info:\n"
 "    -i     - print bitstream info\n"
+"    -startup_report - print time spent at each initialization phase up to\n"
+"      the first output chunk (time to first sample)\n"
+"    -opt   - print processing options\n"
 "    -hist  - print levels histogram\n"
+"    -meter file.csv - write peak and RMS levels of each output channel for\n"
+"      each window to a CSV file (levels in dB). Turns on -fused. Levels\n"
+"      include output gains (-gain_{ch}) and are measured before clipping.\n"
+"      The file has columns for all channels; channels missing in the\n"
+"      current format are empty.\n"
+"    -meter_bin file - same as -meter, but write a binary file (see\n"
+"      level_meter.h for the format)\n"
+"    -meter_window:N - metering window in ms (default is 100)\n"
+"    -bench_kernels:N - SIMD kernels microbenchmark: run N blocks with the\n"
+"      SIMD and C versions of the output packer and the level meter kernels,\n"
+"      print the speed and the maximum difference of the results. Exits with\n"
+"      an error when the packer kernels give different output (the input\n"
+"      includes exact halves of the LSB to check the rounding).\n"
+"    -simd[+|-] - use SIMD kernels when the CPU supports them on(*)/off\n"
+"      SSE2 is detected at runtime and used by the output packer and the\n"
+"      level meter only, the decoders are not affected. The output packer\n"
+"      gives the same output with SIMD and C kernels, level meter RMS may\n"
+"      differ in the last bits.\n"
+"    -profile - print time spent at each processing stage: parser, decoder,\n"
+"      processor (mixer, agc, delay, resampler), output converter and output.\n"
+"      For each stage number of calls, total time, time per frame and share\n"
+"      of the wall time is printed. Works in single-threaded mode only.\n"
+"    -profile_json file.json - same as -profile and also write the profile\n"
+"      to a file in JSON format\n"
 "    -log logfile - dump processing log to a file\n"
+"      The log is written at a background thread. When events come faster\n"
+"      than they are written, extra events are dropped and counted.\n"
 "    -log_level:level - maximum level for log events:\n"
 "      critical  - critical error, so program cannot continue\n"
 "      exception - exceptions\n"
@@ -103,6 +201,13 @@ const char *usage =
 "  automatic gain control options:\n"
 "    -agc[+|-] - auto gain control on(*)/off\n"
 "    -normalize[+|-] - one-pass normalize on/off(*)\n"
+"    -normalize2 - exact two-pass normalization\n"
+"      The first pass scans the file for the true peak level (4x oversampled)\n"
+"      after processing (at all CPU cores, or at N threads given with\n"
+"      -dec_threads), the second pass applies a constant gain so the true\n"
+"      peak reaches the master gain level (-gain, 0dB by default). With\n"
+"      -start/-end only the part that is output is scanned. Turns off -agc\n"
+"      and -normalize.\n"
 "    -drc[+|-] - dynamic range compression on/off(*)\n"
 "    -drc_power:N - dynamic range compression level (dB)\n"
 "    -attack:N - attack speed (dB/s)\n"